@@ -4,6 +4,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <atomic>
 #include "artd/vecmath.h"
 
 #include <glm/glm.hpp> // all types inspired from GLSL
@@ -988,6 +989,7 @@ public:
 
 void
 CachedMeshLoader::onMeshDestroy(CachedMesh *mesh) {
+    synchronized(cacheLock_);
     auto found = cache_.find(RcString(mesh->getName()));
     if(found != cache_.end()) {
         cache_.erase(found);
@@ -999,14 +1001,18 @@ CachedMeshLoader::loadMesh( StringArg pathName) {
 
     RcString key(pathName);
 
-    MMapT::iterator found = cache_.find(key);
-    if(found != cache_.end()) {
-        WeakPtr<CachedMesh> &wp = found->second;
-        ObjectPtr<CachedMesh> op = wp.lock();
-        if(op) {
-            return(op);
+    // op is released outside the lock as its destructor takes it.
+    ObjectPtr<CachedMesh> op;
+    {
+        synchronized(cacheLock_);
+        MMapT::iterator found = cache_.find(key);
+        if(found != cache_.end()) {
+            op = found->second.lock();
         }
     }
+    if(op) {
+        return(op);
+    }
 
     std::vector<float> pointData;
     std::vector<uint16_t> indexData;
@@ -1018,13 +1024,39 @@ CachedMeshLoader::loadMesh( StringArg pathName) {
         return(nullptr);
     }
 
-    ObjectPtr<CachedMesh> loaded = ObjectPtr<CachedMesh>::make(this,key.c_str());
-    cache_.emplace(key,WeakPtr<CachedMesh>(loaded));
+    ObjectPtr<CachedMesh> loaded;
+    {
+        // another thread may have loaded it while we were
+        synchronized(cacheLock_);
+        MMapT::iterator found = cache_.find(key);
+        if(found != cache_.end()) {
+            op = found->second.lock();
+        }
+        if(!op) {
+            loaded = ObjectPtr<CachedMesh>::make(this,key.c_str());
+            cache_[key] = WeakPtr<CachedMesh>(loaded);
+        }
+    }
+    if(op) {
+        return(op);
+    }
 
     loaded->indexCount_ = (int)indexData.size();
 
-    loaded->iChunk_ = owner().bufferManager_->allocIndexChunk((int)indexData.size(), (const uint16_t *)(indexData.data()));
-    loaded->vChunk_ = owner().bufferManager_->allocVertexChunk((int)pointData.size(), pointData.data());
+    // written directly on the render thread outside a batch, other threads need one
+    // of their own so the fence covers both uploads
+    GpuBufferManager *buffers = owner().bufferManager_.get();
+    bool ownBatch = buffers->currentUploadFence() == 0 && !buffers->isRenderThread();
+    if(ownBatch) {
+        buffers->beginUploadBatch();
+    }
+    loaded->uploadFence_ = buffers->currentUploadFence();
+    loaded->iChunk_ = buffers->allocIndexChunk((int)indexData.size(), (const uint16_t *)(indexData.data()));
+    loaded->vChunk_ = buffers->allocVertexChunk((int)pointData.size(), pointData.data());
+    if(ownBatch) {
+        buffers->endUploadBatch();
+    }
+    loaded->computeBounds(pointData.data(), (int)pointData.size(), GpuVertexAttributes::floatsPerVertex());
     return(loaded);
 }
 
@@ -1032,14 +1064,13 @@ ObjectPtr<DrawableMesh>
 CachedMeshLoader::createMesh(const DrawableMeshDescriptor &desc) {
 
     // cludge for generating names for un-named meshes.
-    static int id = 0;
+    static std::atomic<int> id(0);
 
     RcString key;
     if(desc.cacheName) {
         key = desc.cacheName;
     } else {
-        key = RcString::format("_mesh-%d_", id);
-        ++id;
+        key = RcString::format("_mesh-%d_", id++);
     }
     
     if(desc.vertexCount == 0 || desc.indexCount == 0 || desc.vertices == nullptr || desc.indices == nullptr) {
@@ -1047,24 +1078,53 @@ CachedMeshLoader::createMesh(const DrawableMeshDescriptor &desc) {
         return(nullptr);
     }
 
-    MMapT::iterator found = cache_.find(key);
-    if(found != cache_.end()) {
-        AD_LOG(error) << "mesh \"" << key << "\" already in use!";
-        return(nullptr);
+    ObjectPtr<CachedMesh> loaded;
+    {
+        synchronized(cacheLock_);
+        MMapT::iterator found = cache_.find(key);
+        if(found != cache_.end()) {
+            AD_LOG(error) << "mesh \"" << key << "\" already in use!";
+            return(nullptr);
+        }
+        loaded = ObjectPtr<CachedMesh>::make(this,key.c_str());
+        cache_.emplace(key,WeakPtr<CachedMesh>(loaded));
     }
 
-    ObjectPtr<CachedMesh> loaded = ObjectPtr<CachedMesh>::make(this,key.c_str());
-    cache_.emplace(key,WeakPtr<CachedMesh>(loaded));
-
     const float *vertices = (float*)(desc.vertices);
     uint32_t vertexCount = desc.vertexCount * GpuVertexAttributes::floatsPerVertex();
     
     loaded->indexCount_ = (int)(desc.indexCount);
-    loaded->iChunk_ = owner().bufferManager_->allocIndexChunk(desc.indexCount, desc.indices);
-    loaded->vChunk_ = owner().bufferManager_->allocVertexChunk(vertexCount, vertices );
+
+    GpuBufferManager *buffers = owner().bufferManager_.get();
+    bool ownBatch = buffers->currentUploadFence() == 0 && !buffers->isRenderThread();
+    if(ownBatch) {
+        buffers->beginUploadBatch();
+    }
+    loaded->uploadFence_ = buffers->currentUploadFence();
+    loaded->iChunk_ = buffers->allocIndexChunk(desc.indexCount, desc.indices);
+    loaded->vChunk_ = buffers->allocVertexChunk(vertexCount, vertices );
+    if(ownBatch) {
+        buffers->endUploadBatch();
+    }
+    loaded->computeBounds(vertices, (int)vertexCount, GpuVertexAttributes::floatsPerVertex());
 
     return(loaded);
 }
 
+void
+CachedMeshLoader::beginBatch() {
+    owner().bufferManager_->beginUploadBatch();
+}
+
+void
+CachedMeshLoader::endBatch() {
+    owner().bufferManager_->endUploadBatch();
+}
+
+void
+CachedMeshLoader::setMegabufferMode(bool on) {
+    owner().bufferManager_->setGeometryMegabuffer(on);
+}
+
 
 ARTD_END
@@ -0,0 +1,495 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include "artd/GpuEngine-PanamaExports.h"
+#include "./RangeAllocator.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// A run of bytes moved down within a buffer by compaction.
+struct RangeMove {
+    uint64_t from;
+    uint64_t to;
+    uint64_t size;
+};
+
+// Placement policy for handing out chunks of GPU buffers.  It is independent of the
+// graphics API so it can be run and benchmarked on a machine without a GPU.
+//
+// Small chunks are sub-allocated from pooled buffers of a usage type with a RangeAllocator.
+// Large ones get a dedicated buffer of their own.  Pools that get fragmented are compacted.
+//
+// The public methods are thread safe, each allocator has its own lock so a set of them
+// can be used as shards.  The lock is not held while the backend creates a buffer.
+//
+// BackendT supplies the buffers:
+//
+//    typedef ... BufferT;  // buffer handle, pools are derived from it
+//    BufferT createBuffer(uint64_t size, int usage, bool dedicated);  // null handle on failure
+//    void releaseBuffer(BufferT &buf);
+//    uint64_t maxBufferSize();
+//    uint32_t alignment(int usage);  // of chunk offsets and sizes
+//    void moveRanges(BufferT &buf, const RangeMove *moves, int count);  // ascending, to lower offsets
+//    bool canCompactNow();  // false if moveRanges() can't be called on this thread
+//    void scheduleCompaction();  // call runCompactionPass() before the buffers are next used
+//
+// PieceT is the chunk handed out to users:
+//
+//    void setParent(BufferT *buf);
+//    BufferT *getParentBuffer() const;
+//    void setStart(uint64_t start);
+//    void setSize(uint64_t size);
+//    uint64_t getSize() const;
+//    void setBlock(RangeAllocator::Block *block);
+//    RangeAllocator::Block *getBlock() const;
+//    void onRelocated();
+
+template<class BackendT, class PieceT>
+class ChunkAllocator
+{
+public:
+    typedef typename BackendT::BufferT BufferT;
+
+    static const uint32_t defaultPoolSize = 0x7FFFFF;
+    static const uint64_t defaultDedicatedThreshold = 0x200000;  // larger requests get a buffer of their own
+    static const uint32_t minCompactHoleSize = 0x10000;  // don't bother moving things for less
+
+    class Pool
+        : public BufferT
+    {
+        friend class ChunkAllocator;
+
+        ChunkAllocator *owner_;
+        bool compactionScheduled_ = false;
+    public:
+        uint64_t myAllocationSize_ = 0; // size this buffer is currently allocated for
+        int64_t maxUsed_ = 0; // max used in this buffer
+        int     usage_ = 0;
+
+        // free list sub-allocator for the ranges in this buffer, null if dedicated
+        std::unique_ptr<RangeAllocator> ranges_;
+        // holds a single large piece. not in the pools.
+        PieceT *dedicatedPiece_ = nullptr;
+        uint64_t allocCount_ = 0;
+        uint64_t freeCount_ = 0;
+
+        Pool(ChunkAllocator *owner, BufferT buf, int usage)
+            : BufferT(buf)
+            , owner_(owner)
+            , usage_(usage)
+        {
+        }
+
+        INL bool canBeType(int usage) const {
+            return((usage_ & usage) == usage);
+        }
+        INL bool isDedicated() const {
+            return(!ranges_);
+        }
+        INL void setMyAllocationSize(uint64_t allocSize) {
+            myAllocationSize_ = allocSize;
+            ranges_.reset(new RangeAllocator((uint32_t)allocSize, owner_->backend_.alignment(usage_)));
+        }
+        INL uint32_t available() const {
+            return(ranges_->freeBytes());
+        }
+
+        void getStats(GpuBufferStats &stats) const {
+            stats = GpuBufferStats();
+            stats.usage = usage_;
+            stats.dedicated = isDedicated() ? 1 : 0;
+            stats.bufferCount = 1;
+            stats.bytesReserved = (int64_t)myAllocationSize_;
+            stats.maxUsed = maxUsed_;
+            stats.allocCount = (int64_t)allocCount_;
+            stats.freeCount = (int64_t)freeCount_;
+            if (isDedicated()) {
+                stats.bytesLive = dedicatedPiece_ ? (int64_t)dedicatedPiece_->getSize() : 0;
+                return;
+            }
+            stats.bytesLive = ranges_->usedBytes();
+            stats.bytesFree = ranges_->freeBytes();
+            stats.holeBytes = ranges_->holeBytes();
+            stats.holeCount = ranges_->holeCount();
+            stats.largestFreeBlock = ranges_->largestFreeBlock();
+        }
+
+    private:
+
+        // worth compacting when enough is lost in holes between pieces
+        INL bool isFragmented() const {
+            uint32_t holes = ranges_->holeBytes();
+            return(holes >= minCompactHoleSize && holes >= (ranges_->usedBytes() >> 2));
+        }
+
+        void scheduleCompaction() {
+            if (!compactionScheduled_) {
+                compactionScheduled_ = true;
+                owner_->scheduleCompactionPass();
+            }
+        }
+
+        INL void attachPiece(PieceT *piece, RangeAllocator::Block *block) {
+            block->user_ = piece;
+            piece->setBlock(block);
+            piece->setParent(this);
+            piece->setStart(block->offset());
+            piece->setSize(block->size());
+            if ((int64_t)block->endOffset() > maxUsed_) {
+                maxUsed_ = (int64_t)block->endOffset();
+            }
+        }
+
+        // the whole buffer belongs to a single large piece, its size rounded up to the 4
+        // bytes copies and writes are made in.
+        INL void attachDedicated(PieceT *piece, uint64_t size) {
+            size = ARTD_ALIGN_UP(size, 4);
+            ++allocCount_;
+            dedicatedPiece_ = piece;
+            piece->setParent(this);
+            piece->setStart(0);
+            piece->setSize(size);
+            if ((int64_t)size > maxUsed_) {
+                maxUsed_ = (int64_t)size;
+            }
+        }
+
+        // allocate a range for a piece not currently in a buffer, false if no room
+        bool allocPiece(PieceT *piece, uint32_t newSize) {
+            RangeAllocator::Block *block = ranges_->allocate(newSize);
+            if (!block) {
+                return(false);
+            }
+            ++allocCount_;
+            attachPiece(piece, block);
+            return(true);
+        }
+
+        // grow or shrink a piece in place, false if it has to be moved.
+        bool resizePiece(PieceT *piece, uint32_t newSize) {
+            RangeAllocator::Block *block = piece->getBlock();
+            if (!ranges_->tryResize(block, newSize)) {
+                return(false);
+            }
+            attachPiece(piece, block);
+            return(true);
+        }
+
+        // note: deletes this if dedicated
+        void removePiece(PieceT *piece) {
+            ++freeCount_;
+            if (isDedicated()) {
+                piece->setParent(nullptr);
+                piece->setSize(0);
+                dedicatedPiece_ = nullptr;
+                owner_->releaseDedicated(this);
+                return;
+            }
+            ranges_->free(piece->getBlock());
+            piece->setBlock(nullptr);
+            piece->setParent(nullptr);
+            piece->setSize(0);
+            if (isFragmented() || ranges_->usedBytes() == 0) {
+                scheduleCompaction();
+            }
+        }
+    };
+
+private:
+
+    BackendT &backend_;
+    mutable std::mutex lock_;
+    uint32_t poolSize_;
+    uint64_t dedicatedThreshold_;
+
+    std::vector<Pool*> pools_;  // shared by small chunks
+    std::vector<Pool*> dedicated_;  // one per large chunk
+    std::vector<RangeMove> moves_;
+    bool compactionPassScheduled_ = false;
+
+    // counts from buffers since released
+    uint64_t retiredAllocCount_ = 0;
+    uint64_t retiredFreeCount_ = 0;
+
+    // the lock is let go while the buffer is created as the backend may have to wait on the device
+    Pool *createPool(int usage, std::unique_lock<std::mutex> &hold) {
+        hold.unlock();
+        BufferT buf = backend_.createBuffer(poolSize_, usage, false);
+        hold.lock();
+        if (!buf) {
+            return(nullptr);
+        }
+        Pool *bb = new Pool(this, buf, usage);
+        bb->setMyAllocationSize(poolSize_);
+        pools_.push_back(bb);
+        return(bb);
+    }
+
+    Pool *createDedicated(uint64_t size, int usage, std::unique_lock<std::mutex> &hold) {
+        hold.unlock();
+        BufferT buf = backend_.createBuffer(size, usage, true);
+        hold.lock();
+        if (!buf) {
+            return(nullptr);
+        }
+        Pool *bb = new Pool(this, buf, usage);
+        bb->myAllocationSize_ = ARTD_ALIGN_UP(size, 16);
+        dedicated_.push_back(bb);
+        return(bb);
+    }
+
+    // destroy a buffer already removed from the lists
+    void retireBuffer(Pool *bb) {
+        retiredAllocCount_ += bb->allocCount_;
+        retiredFreeCount_ += bb->freeCount_;
+        BufferT &buf = *bb;
+        backend_.releaseBuffer(buf);
+        delete(bb);
+    }
+
+    void releaseDedicated(Pool *bb) {
+        auto found = std::find(dedicated_.begin(), dedicated_.end(), bb);
+        if (found != dedicated_.end()) {
+            dedicated_.erase(found);
+        }
+        retireBuffer(bb);
+    }
+
+    void scheduleCompactionPass() {
+        if (compactionPassScheduled_) {
+            return;
+        }
+        compactionPassScheduled_ = true;
+        backend_.scheduleCompaction();
+    }
+
+public:
+
+    ChunkAllocator(BackendT &backend, uint32_t poolSize = defaultPoolSize, uint64_t dedicatedThreshold = defaultDedicatedThreshold)
+        : backend_(backend)
+        , poolSize_(poolSize)
+        , dedicatedThreshold_(dedicatedThreshold)
+    {
+    }
+    ~ChunkAllocator() {
+        releaseAll();
+    }
+
+    // sizes for pools created from now on
+    void setSizes(uint32_t poolSize, uint64_t dedicatedThreshold) {
+        std::lock_guard<std::mutex> hold(lock_);
+        poolSize_ = poolSize;
+        dedicatedThreshold_ = dedicatedThreshold;
+    }
+
+    static INL Pool *poolOf(const PieceT *piece) {
+        return(static_cast<Pool*>(piece->getParentBuffer()));
+    }
+
+    // allocator a placed piece is in, null if not placed
+    static INL ChunkAllocator *ownerOf(const PieceT *piece) {
+        Pool *bb = poolOf(piece);
+        return(bb ? bb->owner_ : nullptr);
+    }
+
+    // give back a piece's range, for when the piece is destroyed
+    static void releasePiece(PieceT *piece) {
+        Pool *bb = poolOf(piece);
+        if (bb) {
+            std::lock_guard<std::mutex> hold(bb->owner_->lock_);
+            bb->removePiece(piece);
+        }
+    }
+
+    // Place a piece, moving it if it is already placed and does not fit where it is.
+    // dedicated gives it a buffer of its own whatever the size.  returns false if it
+    // could not be placed.
+    bool allocOrRealloc(PieceT *bd, uint64_t size, int usage, bool dedicated = false) {
+
+        if (size == 0) {
+            return(false);
+        }
+
+        std::unique_lock<std::mutex> hold(lock_);
+
+        dedicated = dedicated || size > dedicatedThreshold_;
+
+        Pool *bb = poolOf(bd);
+        if (bb) {
+            if (bb->isDedicated()) {
+                // keep the buffer if it still fits and is not mostly wasted
+                if (dedicated && size <= bb->myAllocationSize_
+                    && size >= (bb->myAllocationSize_ >> 1))
+                {
+                    bd->setSize(ARTD_ALIGN_UP(size, 4));
+                    return(true);
+                }
+            } else if (!dedicated && bb->resizePiece(bd, (uint32_t)size)) {
+                // grew or shrank in place as the following range is free.
+                return(true);
+            }
+            bb->removePiece(bd);
+        }
+
+        if (dedicated) {
+            if (ARTD_ALIGN_UP(size,16) > backend_.maxBufferSize()) {
+                return(false);
+            }
+            bb = createDedicated(size, usage, hold);
+            if (!bb) {
+                return(false);
+            }
+            bb->attachDedicated(bd, size);
+            return(true);
+        }
+        uint32_t poolSize = (uint32_t)size;
+
+        // first buffer of the right type with a free range big enough
+        for(Pool *glb : pools_) {
+            if (glb->canBeType(usage) && glb->allocPiece(bd, poolSize)) {
+                return(true);
+            }
+        }
+
+        // compact a fragmented buffer that has the room before making a new one
+        bool canCompact = backend_.canCompactNow();
+        for(Pool *glb : pools_) {
+            if (!canCompact || !glb->canBeType(usage) || glb->available() < poolSize || glb->ranges_->holeBytes() == 0) {
+                continue;
+            }
+            compactPool(glb);
+            if (glb->allocPiece(bd, poolSize)) {
+                return(true);
+            }
+        }
+
+        bb = createPool(usage, hold);
+        return(bb && bb->allocPiece(bd, poolSize));
+    }
+
+    void runCompactionPass() {
+        std::lock_guard<std::mutex> hold(lock_);
+        compactionPassScheduled_ = false;
+
+        for(int i = (int)pools_.size(); i > 0;) {
+            --i;
+            Pool *bb = pools_[i];
+            if (!bb->compactionScheduled_) {
+                continue;
+            }
+            bb->compactionScheduled_ = false;
+
+            // give back buffers no longer in use as long as there is another of the type
+            if (bb->ranges_->usedBytes() == 0) {
+                bool haveOther = false;
+                for(Pool *other : pools_) {
+                    if (other != bb && other->usage_ == bb->usage_) {
+                        haveOther = true;
+                        break;
+                    }
+                }
+                if (haveOther) {
+                    pools_.erase(pools_.begin() + i);
+                    retireBuffer(bb);
+                }
+                continue;
+            }
+            if (bb->isFragmented()) {
+                compactPool(bb);
+            }
+        }
+    }
+
+private:
+
+    // Slide all the live pieces in a pool down over the holes and update their
+    // start offsets.  The backend moves the contents, contiguous pieces are coalesced
+    // into a single move.
+    void compactPool(Pool *bb) {
+        moves_.clear();
+        bb->ranges_->compact([this](RangeAllocator::Block *block, uint32_t from, uint32_t to) {
+            RangeMove *last = moves_.empty() ? nullptr : &moves_.back();
+            if (last && (last->from + last->size) == from && (last->to + last->size) == to) {
+                last->size += block->size();
+            } else {
+                moves_.push_back({ from, to, block->size() });
+            }
+            PieceT *piece = static_cast<PieceT*>(block->user_);
+            piece->setStart(to);
+            piece->onRelocated();
+        });
+        if (!moves_.empty()) {
+            BufferT &buf = *bb;
+            backend_.moveRanges(buf, moves_.data(), (int)moves_.size());
+        }
+    }
+
+public:
+
+    // release all buffers, pieces still referenced are orphaned.
+    void releaseAll() {
+        std::lock_guard<std::mutex> hold(lock_);
+        for(Pool *bb : pools_) {
+            for(auto *block = bb->ranges_->firstBlock(); block; block = block->nextPhys()) {
+                if (!block->isFree() && block->user_) {
+                    PieceT *piece = static_cast<PieceT*>(block->user_);
+                    piece->setBlock(nullptr);
+                    piece->setParent(nullptr);
+                    piece->setSize(0);
+                }
+            }
+            retireBuffer(bb);
+        }
+        pools_.clear();
+        for(Pool *bb : dedicated_) {
+            if (bb->dedicatedPiece_) {
+                bb->dedicatedPiece_->setParent(nullptr);
+                bb->dedicatedPiece_->setSize(0);
+            }
+            retireBuffer(bb);
+        }
+        dedicated_.clear();
+    }
+
+    INL int bufferCount() const {
+        std::lock_guard<std::mutex> hold(lock_);
+        return((int)(pools_.size() + dedicated_.size()));
+    }
+
+    // appends per buffer statistics, pools first, and adds to the totals
+    void getStats(std::vector<GpuBufferStats> &perBuffer, GpuBufferStats &total) const {
+
+        std::lock_guard<std::mutex> hold(lock_);
+        total.allocCount += (int64_t)retiredAllocCount_;
+        total.freeCount += (int64_t)retiredFreeCount_;
+
+        size_t ix = perBuffer.size();
+        perBuffer.resize(ix + pools_.size() + dedicated_.size());
+        for(auto *list : { &pools_, &dedicated_ }) {
+            for(Pool *bb : *list) {
+                GpuBufferStats &stats = perBuffer[ix++];
+                bb->getStats(stats);
+                total.bufferCount += 1;
+                total.bytesReserved += stats.bytesReserved;
+                total.bytesLive += stats.bytesLive;
+                total.bytesFree += stats.bytesFree;
+                total.holeBytes += stats.holeBytes;
+                total.holeCount += stats.holeCount;
+                total.largestFreeBlock = std::max(total.largestFreeBlock, stats.largestFreeBlock);
+                total.maxUsed += stats.maxUsed;
+                total.allocCount += stats.allocCount;
+                total.freeCount += stats.freeCount;
+            }
+        }
+    }
+};
+
+#undef INL
+
+ARTD_END
@@ -0,0 +1,206 @@
+#include "GpuEngineImpl.h"
+#include "./CullingPass.h"
+#include "artd/DrawableMesh.h"
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+static const uint32_t cullWorkgroupSize = 64;  // as in cullInstances.wgsl
+
+CullingPass::CullingPass(GpuEngineImpl *owner)
+    : owner_(*owner), device_(owner->device())
+{
+    using namespace wgpu;
+
+    inputBuffer_ = owner_.bufferManager()->allocStorageChunk(owner_.deviceProfile().instanceCapacity * sizeof(CullInput));
+
+    BindGroupLayoutEntry bindingLayouts[5];
+
+    bindingLayouts[0] = Default;
+    bindingLayouts[0].binding = 0;
+    bindingLayouts[0].visibility = ShaderStage::Compute;
+    bindingLayouts[0].buffer.type = BufferBindingType::Uniform;
+    bindingLayouts[0].buffer.minBindingSize = sizeof(SceneUniforms);
+
+    bindingLayouts[1] = Default;
+    bindingLayouts[1].binding = 1;
+    bindingLayouts[1].visibility = ShaderStage::Compute;
+    bindingLayouts[1].buffer.type = BufferBindingType::ReadOnlyStorage;
+    bindingLayouts[1].buffer.minBindingSize = owner_.instanceStride();
+
+    bindingLayouts[2] = Default;
+    bindingLayouts[2].binding = 2;
+    bindingLayouts[2].visibility = ShaderStage::Compute;
+    bindingLayouts[2].buffer.type = BufferBindingType::ReadOnlyStorage;
+    bindingLayouts[2].buffer.minBindingSize = sizeof(CullInput);
+
+    bindingLayouts[3] = Default;
+    bindingLayouts[3].binding = 3;
+    bindingLayouts[3].visibility = ShaderStage::Compute;
+    bindingLayouts[3].buffer.type = BufferBindingType::Storage;
+    bindingLayouts[3].buffer.minBindingSize = sizeof(DrawIndexedIndirectArgs);
+
+    bindingLayouts[4] = Default;
+    bindingLayouts[4].binding = 4;
+    bindingLayouts[4].visibility = ShaderStage::Compute;
+    bindingLayouts[4].buffer.type = BufferBindingType::Storage;
+    bindingLayouts[4].buffer.minBindingSize = sizeof(uint32_t);
+
+    BindGroupLayoutDescriptor bindGroupLayoutDesc{};
+    bindGroupLayoutDesc.entryCount = 5;
+    bindGroupLayoutDesc.entries = bindingLayouts;
+    bindGroupLayout_ = device_.createBindGroupLayout(bindGroupLayoutDesc);
+
+    PipelineLayoutDescriptor layoutDesc{};
+    layoutDesc.bindGroupLayoutCount = 1;
+    layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&bindGroupLayout_;
+    PipelineLayout layout = device_.createPipelineLayout(layoutDesc);
+
+    ShaderModule module = owner_.shaderManager_->getVariant("cullInstances.wgsl", owner_.instanceFeatures());
+
+    ComputePipelineDescriptor pipelineDesc;
+    pipelineDesc.label = "Cull instances";
+    pipelineDesc.layout = layout;
+    pipelineDesc.compute.module = module;
+    pipelineDesc.compute.entryPoint = "cull_main";
+    pipelineDesc.compute.constantCount = 0;
+    pipelineDesc.compute.constants = nullptr;
+    pipeline_ = device_.createComputePipeline(pipelineDesc);
+
+    layout.release();
+}
+
+CullingPass::~CullingPass() {
+    if(bindGroup_) {
+        bindGroup_.release();
+    }
+    if(pipeline_) {
+        pipeline_.release();
+    }
+    if(bindGroupLayout_) {
+        bindGroupLayout_.release();
+    }
+}
+
+// the chunks of the bindings in binding order
+void
+CullingPass::getChunks(BufferChunk *chunks[BindingCount]) {
+    chunks[0] = owner_.uniformBuffer_.get();
+    chunks[1] = owner_.instanceBuffer_.get();
+    chunks[2] = inputBuffer_.get();
+    chunks[3] = owner_.indirectBuffer_.get();
+    chunks[4] = owner_.visibleBuffer_.get();
+}
+
+bool
+CullingPass::bindingsMoved() {
+    BufferChunk *chunks[BindingCount];
+    getChunks(chunks);
+    for(int i = 0; i < BindingCount; ++i) {
+        const BoundRange &r = bound_[i];
+        if(r.buffer != (WGPUBuffer)chunks[i]->getBuffer() || r.offset != chunks[i]->getStartOffset()
+           || r.size != chunks[i]->getSize()) {
+            return(true);
+        }
+    }
+    return(false);
+}
+
+// (re)create the bind group, needed whenever one of the chunks in it moves
+void
+CullingPass::createBindGroup() {
+
+    using namespace wgpu;
+
+    BindGroupEntry bindings[BindingCount];
+    BufferChunk *chunks[BindingCount];
+    getChunks(chunks);
+    for(int i = 0; i < BindingCount; ++i) {
+        BufferChunk &b = *chunks[i];
+        bindings[i].binding = i;
+        bindings[i].buffer = b.getBuffer();
+        bindings[i].offset = b.getStartOffset();
+        bindings[i].size = b.getSize();
+        bound_[i] = { b.getBuffer(), b.getStartOffset(), b.getSize() };
+    }
+
+    if(bindGroup_) {
+        bindGroup_.release();
+    }
+    BindGroupDescriptor bindGroupDesc;
+    bindGroupDesc.layout = bindGroupLayout_;
+    bindGroupDesc.entryCount = BindingCount;
+    bindGroupDesc.entries = bindings;
+    bindGroup_ = device_.createBindGroup(bindGroupDesc);
+}
+
+uint32_t
+CullingPass::ensureCapacity(uint32_t count) {
+
+    uint32_t capacity = (uint32_t)(inputBuffer_->getSize() / sizeof(CullInput));
+    if(count <= capacity) {
+        return(count);
+    }
+    if(!owner_.bufferManager()->growChunk(inputBuffer_, (uint64_t)count * sizeof(CullInput))) {
+        return(capacity);
+    }
+    if(bindGroup_) {
+        bindGroup_.release();
+        bindGroup_ = nullptr;
+    }
+    return(count);
+}
+
+uint32_t
+CullingPass::stageInputs() {
+
+    const RenderQueue &queue = owner_.renderQueue_;
+    const std::vector<GpuEngineImpl::DrawGroup> &groups = owner_.drawGroups_;
+    uint32_t count = (uint32_t)queue.size();
+    if(count == 0) {
+        return(0);
+    }
+    auto *inputs = (CullInput *)owner_.bufferManager()->stageFrameUpload(inputBuffer_, 0, count * sizeof(CullInput));
+    if(!inputs) {
+        return(0);
+    }
+    for(uint32_t g = 0; g < (uint32_t)groups.size(); ++g) {
+        const GpuEngineImpl::DrawGroup &group = groups[g];
+        CullInput *in = inputs + group.firstInstance;
+        for(uint32_t i = 0; i < group.instanceCount; ++i) {
+            in[i].sphere = group.mesh->bounds_;
+            in[i].group = g;
+        }
+    }
+    return(count);
+}
+
+void
+CullingPass::encode(wgpu::CommandEncoder &encoder, uint32_t instanceCount) {
+
+    using namespace wgpu;
+
+    if(instanceCount == 0) {
+        return;
+    }
+
+    if(!bindGroup_ || bindingsMoved()) {
+        createBindGroup();
+    }
+
+    ComputePassDescriptor passDesc;
+    passDesc.label = "Cull instances";
+    passDesc.timestampWriteCount = 0;
+    passDesc.timestampWrites = nullptr;
+    ComputePassEncoder pass = encoder.beginComputePass(passDesc);
+    pass.setPipeline(pipeline_);
+    pass.setBindGroup(0, bindGroup_, 0, nullptr);
+    pass.dispatchWorkgroups((instanceCount + cullWorkgroupSize - 1) / cullWorkgroupSize, 1, 1);
+    pass.end();
+    pass.release();
+}
+
+#undef INL
+
+ARTD_END
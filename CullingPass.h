@@ -0,0 +1,72 @@
+#pragma once
+
+#include "artd/gpu_engine.h"
+#include "artd/ObjectBase.h"
+#include "artd/vecmath.h"
+#include <webgpu/webgpu.hpp>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+class GpuEngineImpl;
+class BufferChunk;
+
+// per instance input to the culling shader
+struct CullInput {
+    glm::vec4 sphere;  // mesh bounds, radius < 0 if unknown
+    uint32_t group;    // draw group the instance is in
+    uint32_t _pad[3];
+};
+
+static_assert(sizeof(CullInput) % 16 == 0);
+
+// Compute pass frustum culling the frame's instances against SceneUniforms::vpMatrix.
+// Survivors are compacted into the engine's visible array by draw group and counted
+// into the indirect draw arguments, see shaders/cullInstances.wgsl.
+class ARTD_API_GPU_ENGINE CullingPass {
+    GpuEngineImpl &owner_;
+public:
+    INL GpuEngineImpl &getOwner() {
+        return(owner_);
+    }
+    CullingPass(GpuEngineImpl *owner);
+    ~CullingPass();
+
+    // grows the input array for count instances, returns the count it holds
+    uint32_t ensureCapacity(uint32_t count);
+    // stages the cull inputs for the frame's render queue, returns the count of
+    // instances to cull, 0 if it couldn't.
+    uint32_t stageInputs();
+    // the uploads need to have been flushed into the encoder first
+    void encode(wgpu::CommandEncoder &encoder, uint32_t instanceCount);
+
+private:
+    static const int BindingCount = 5;
+
+    // where a binding's chunk was when the bind group was made
+    class BoundRange {
+    public:
+        WGPUBuffer buffer;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    void getChunks(BufferChunk *chunks[BindingCount]);
+    bool bindingsMoved();
+    void createBindGroup();
+
+    wgpu::Device device_;
+    ObjectPtr<BufferChunk> inputBuffer_;
+
+    wgpu::BindGroupLayout bindGroupLayout_ = nullptr;
+    wgpu::BindGroup bindGroup_ = nullptr;
+    // Grown arrays are new chunks and compaction moves them, either way the range
+    // differs from the one bound.
+    BoundRange bound_[BindingCount] = {};
+    wgpu::ComputePipeline pipeline_ = nullptr;
+};
+
+#undef INL
+
+ARTD_END
@@ -0,0 +1,152 @@
+#include "./DawnBlobCache.h"
+#include "artd/Logger.h"
+
+#ifdef ARTD_DAWN_BLOB_CACHE
+
+#include <dawn/native/DawnNative.h>
+#include <dawn/platform/DawnPlatform.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+ARTD_BEGIN
+
+namespace { // anonymous local namespace
+
+// Each entry is a file holding the key then the value, the key is compared on load
+// as the name is only its hash.  Dawn may load and store from its compile threads.
+class DiskCachingInterface : public dawn::platform::CachingInterface {
+    std::filesystem::path directory_;
+    std::mutex lock_;
+
+    std::filesystem::path pathFor(const void *key, size_t keySize) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        const uint8_t *bytes = (const uint8_t *)key;
+        for(size_t i = 0; i < keySize; ++i) {
+            h ^= bytes[i];
+            h *= 0x100000001b3ull;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)h);
+        return(directory_ / name);
+    }
+
+public:
+    DiskCachingInterface(const std::filesystem::path &directory)
+        : directory_(directory)
+    {}
+
+    // with valueOut null and valueSize 0 only the size is returned, 0 when not cached
+    size_t LoadData(const void *key, size_t keySize, void *valueOut, size_t valueSize) override {
+
+        std::lock_guard<std::mutex> lock(lock_);
+        std::ifstream file(pathFor(key, keySize), std::ios::binary | std::ios::ate);
+        if(!file.is_open()) {
+            return(0);
+        }
+        size_t fileSize = (size_t)file.tellg();
+        uint64_t storedKeySize = 0;
+        size_t header = sizeof(storedKeySize) + keySize;
+        if(fileSize < header) {
+            return(0);
+        }
+        file.seekg(0);
+        file.read((char *)&storedKeySize, sizeof(storedKeySize));
+        if(storedKeySize != keySize) {
+            return(0);
+        }
+        std::vector<char> storedKey(keySize);
+        file.read(storedKey.data(), keySize);
+        if(!file || memcmp(storedKey.data(), key, keySize) != 0) {
+            return(0);
+        }
+        size_t size = fileSize - header;
+        if(valueOut == nullptr) {
+            return(size);
+        }
+        if(valueSize < size) {
+            return(0);
+        }
+        file.read((char *)valueOut, size);
+        return(file ? size : 0);
+    }
+
+    void StoreData(const void *key, size_t keySize, const void *value, size_t valueSize) override {
+
+        std::lock_guard<std::mutex> lock(lock_);
+        std::filesystem::path path = pathFor(key, keySize);
+        std::filesystem::path temp = path;
+        temp += ".tmp";
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            if(!file.is_open()) {
+                return;
+            }
+            uint64_t storedKeySize = keySize;
+            file.write((const char *)&storedKeySize, sizeof(storedKeySize));
+            file.write((const char *)key, keySize);
+            file.write((const char *)value, valueSize);
+            if(!file) {
+                return;
+            }
+        }
+        // a reader never sees a part written entry
+        std::error_code ec;
+        std::filesystem::rename(temp, path, ec);
+        if(ec) {
+            std::filesystem::remove(temp, ec);
+        }
+    }
+};
+
+class CachingPlatform : public dawn::platform::Platform {
+    DiskCachingInterface cache_;
+public:
+    CachingPlatform(const std::filesystem::path &directory)
+        : cache_(directory)
+    {}
+    dawn::platform::CachingInterface *GetCachingInterface() override {
+        return(&cache_);
+    }
+};
+
+} // end namespace
+
+const WGPUChainedStruct *
+dawnBlobCacheChain(const std::filesystem::path &directory) {
+
+    // the instance and its devices refer to these until exit
+    static std::unique_ptr<CachingPlatform> platform;
+    static dawn::native::DawnInstanceDescriptor descriptor;
+
+    if(!platform) {
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        if(ec) {
+            AD_LOG(error) << "could not create the cache directory " << directory << ": " << ec.message();
+            return(nullptr);
+        }
+        AD_LOG(info) << "caching shaders and pipelines in " << directory;
+        platform = std::make_unique<CachingPlatform>(directory);
+        descriptor.platform = platform.get();
+    }
+    return(reinterpret_cast<const WGPUChainedStruct *>(&descriptor));
+}
+
+ARTD_END
+
+#else
+
+ARTD_BEGIN
+
+const WGPUChainedStruct *
+dawnBlobCacheChain(const std::filesystem::path &) {
+    return(nullptr);
+}
+
+ARTD_END
+
+#endif
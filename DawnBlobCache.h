@@ -0,0 +1,18 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include <webgpu/webgpu.h>
+#include <filesystem>
+
+ARTD_BEGIN
+
+// Persists the blobs Dawn makes compiling shaders and pipelines, files in a directory
+// named by a hash of Dawn's key, so a warm start loads them instead of compiling.
+// This is kept apart from webgpu.hpp, Dawn's native headers bring their own wgpu
+// namespace.  Only there when built with ARTD_DAWN_BLOB_CACHE.
+
+// The struct to chain on the instance descriptor to use the cache in directory, it is
+// made the first time and kept until exit.  null when there is no cache.
+const WGPUChainedStruct *dawnBlobCacheChain(const std::filesystem::path &directory);
+
+ARTD_END
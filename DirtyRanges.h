@@ -0,0 +1,60 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include <cstdint>
+#include <vector>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// Indices of array elements that changed, marked in ascending order and coalesced into
+// ranges to upload.  Runs less than maxGap apart are merged as one larger copy is
+// cheaper than several small ones.
+
+class DirtyRanges
+{
+public:
+    class Range {
+    public:
+        uint32_t begin;
+        uint32_t end;  // one past the last
+
+        INL uint32_t count() const {
+            return(end - begin);
+        }
+    };
+
+private:
+    std::vector<Range> ranges_;
+    uint32_t maxGap_;
+
+public:
+
+    INL DirtyRanges(uint32_t maxGap = 4)
+        : maxGap_(maxGap)
+    {}
+
+    INL void clear() {
+        ranges_.clear();
+    }
+    INL bool empty() const {
+        return(ranges_.empty());
+    }
+    INL void mark(uint32_t ix) {
+        if(!ranges_.empty() && ix < ranges_.back().end + maxGap_) {
+            if(ix >= ranges_.back().end) {
+                ranges_.back().end = ix + 1;
+            }
+            return;
+        }
+        ranges_.push_back({ ix, ix + 1 });
+    }
+    INL const std::vector<Range> &ranges() const {
+        return(ranges_);
+    }
+};
+
+#undef INL
+
+ARTD_END
@@ -1,5 +1,7 @@
 #include "artd/DrawableMesh.h"
 #include "artd/GpuBufferManager.h"
+#include <algorithm>
+#include <cmath>
 
 ARTD_BEGIN
 
@@ -9,4 +11,30 @@ DrawableMesh::~DrawableMesh() {
 
 }
 
+void
+DrawableMesh::computeBounds(const float *vertices, int floatCount, int floatsPerVertex) {
+
+    if(floatCount < 3 || floatsPerVertex < 3) {
+        bounds_ = glm::vec4(0,0,0,-1);
+        return;
+    }
+    // center of the box around it, radius to the furthest point.
+    glm::vec3 lo(vertices[0], vertices[1], vertices[2]);
+    glm::vec3 hi = lo;
+    for(int i = floatsPerVertex; i + 2 < floatCount; i += floatsPerVertex) {
+        glm::vec3 p(vertices[i], vertices[i+1], vertices[i+2]);
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+    boxMin_ = lo;
+    boxMax_ = hi;
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius2 = 0;
+    for(int i = 0; i + 2 < floatCount; i += floatsPerVertex) {
+        glm::vec3 d = glm::vec3(vertices[i], vertices[i+1], vertices[i+2]) - center;
+        radius2 = std::max(radius2, glm::dot(d, d));
+    }
+    bounds_ = glm::vec4(center, std::sqrt(radius2));
+}
+
 ARTD_END
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include "artd/vecmath.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define ARTD_CULL_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define ARTD_CULL_SSE2 1
+#endif
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// World space bounding spheres kept as structure of arrays so they can be tested
+// against the frustum planes 8 at a time with AVX2, 4 with SSE2, one at a time
+// otherwise.  The arrays are padded to a whole block with spheres that pass.  Those
+// that pass and have a bounding box are then tested with the box moved into world
+// space, which is tighter for long or flat meshes.
+
+class FrustumCuller
+{
+public:
+    static const int BlockSize = 8;
+
+private:
+
+    std::vector<float> x_;
+    std::vector<float> y_;
+    std::vector<float> z_;
+    std::vector<float> radius_;
+    std::vector<uint32_t> items_;
+    // world box center and half size per sphere, half size x < 0 if there is none
+    std::vector<glm::vec3> boxCenter_;
+    std::vector<glm::vec3> boxExtent_;
+
+    float planes_[6][4];  // a x + b y + c z + d, normalized, positive inside
+
+public:
+
+    INL void clear() {
+        x_.clear();
+        y_.clear();
+        z_.clear();
+        radius_.clear();
+        items_.clear();
+        boxCenter_.clear();
+        boxExtent_.clear();
+    }
+    INL size_t size() const {
+        return(items_.size());
+    }
+
+    // radius < 0 is always visible
+    INL void add(const glm::vec3 &center, float radius, uint32_t item) {
+        x_.push_back(center.x);
+        y_.push_back(center.y);
+        z_.push_back(center.z);
+        radius_.push_back(radius < 0 ? FLT_MAX : radius);
+        items_.push_back(item);
+        boxCenter_.push_back(center);
+        boxExtent_.push_back(glm::vec3(-1.0f));
+    }
+
+    // adds the mesh's local sphere moved into world space by the model matrix
+    INL void add(const Matrix4f &model, const glm::vec4 &sphere, uint32_t item) {
+        if(sphere.w < 0) {
+            add(glm::vec3(model[3]), -1.0f, item);
+            return;
+        }
+        glm::vec3 c;
+        for(int i = 0; i < 3; ++i) {
+            c[i] = model[0][i] * sphere.x + model[1][i] * sphere.y + model[2][i] * sphere.z + model[3][i];
+        }
+        float s2 = 0;
+        for(int i = 0; i < 3; ++i) {
+            float l2 = model[i][0] * model[i][0] + model[i][1] * model[i][1] + model[i][2] * model[i][2];
+            s2 = l2 > s2 ? l2 : s2;
+        }
+        add(c, sphere.w * std::sqrt(s2), item);
+    }
+
+    // as above along with the mesh's local box, for a mesh with known bounds
+    INL void add(const Matrix4f &model, const glm::vec4 &sphere, const glm::vec3 &boxMin,
+                 const glm::vec3 &boxMax, uint32_t item) {
+        add(model, sphere, item);
+        glm::vec3 c = (boxMin + boxMax) * 0.5f;
+        glm::vec3 e = (boxMax - boxMin) * 0.5f;
+        glm::vec3 wc, we;
+        for(int i = 0; i < 3; ++i) {
+            wc[i] = model[0][i] * c.x + model[1][i] * c.y + model[2][i] * c.z + model[3][i];
+            we[i] = std::fabs(model[0][i]) * e.x + std::fabs(model[1][i]) * e.y + std::fabs(model[2][i]) * e.z;
+        }
+        boxCenter_.back() = wc;
+        boxExtent_.back() = we;
+    }
+
+    // planes from the rows of projection * view, depth 0..w
+    void setPlanes(const Matrix4f &vp) {
+        for(int p = 0; p < 6; ++p) {
+            int axis = p >> 1;
+            float sign = (p & 1) ? -1.0f : 1.0f;
+            for(int i = 0; i < 4; ++i) {
+                float r3 = vp[i][3];
+                float ra = vp[i][axis];
+                // near plane is z >= 0 not z >= -w
+                planes_[p][i] = (p == 4) ? ra : r3 + sign * ra;
+            }
+            float len = std::sqrt(planes_[p][0] * planes_[p][0] + planes_[p][1] * planes_[p][1]
+                                  + planes_[p][2] * planes_[p][2]);
+            if(len > 0) {
+                for(int i = 0; i < 4; ++i) {
+                    planes_[p][i] /= len;
+                }
+            }
+        }
+    }
+
+    // a box entirely outside one plane, one with no box is never
+    INL bool boxOutside(size_t at) const {
+        const glm::vec3 &c = boxCenter_[at];
+        const glm::vec3 &e = boxExtent_[at];
+        if(e.x < 0) {
+            return(false);
+        }
+        for(int p = 0; p < 6; ++p) {
+            const float *pl = planes_[p];
+            float d = pl[0] * c.x + pl[1] * c.y + pl[2] * c.z + pl[3];
+            float r = std::fabs(pl[0]) * e.x + std::fabs(pl[1]) * e.y + std::fabs(pl[2]) * e.z;
+            if(d < -r) {
+                return(true);
+            }
+        }
+        return(false);
+    }
+
+    // appends the items of the spheres at least partly inside the planes to visible,
+    // less those whose boxes are outside
+    void cull(std::vector<uint32_t> &visible) {
+
+        size_t count = items_.size();
+        if(count == 0) {
+            return;
+        }
+        size_t padded = (count + BlockSize - 1) & ~(size_t)(BlockSize - 1);
+        x_.resize(padded, 0.0f);
+        y_.resize(padded, 0.0f);
+        z_.resize(padded, 0.0f);
+        radius_.resize(padded, FLT_MAX);
+
+        const float *xs = x_.data();
+        const float *ys = y_.data();
+        const float *zs = z_.data();
+        const float *rs = radius_.data();
+
+        for(size_t base = 0; base < count; base += BlockSize) {
+            uint32_t outside = 0;  // bit per sphere
+#if defined(ARTD_CULL_AVX2)
+            __m256 x = _mm256_loadu_ps(xs + base);
+            __m256 y = _mm256_loadu_ps(ys + base);
+            __m256 z = _mm256_loadu_ps(zs + base);
+            __m256 negR = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(rs + base));
+            __m256 out = _mm256_setzero_ps();
+            for(int p = 0; p < 6; ++p) {
+                const float *pl = planes_[p];
+                __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pl[0]), x),
+                                                       _mm256_mul_ps(_mm256_set1_ps(pl[1]), y)),
+                                         _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pl[2]), z),
+                                                       _mm256_set1_ps(pl[3])));
+                out = _mm256_or_ps(out, _mm256_cmp_ps(d, negR, _CMP_LT_OQ));
+            }
+            outside = (uint32_t)_mm256_movemask_ps(out);
+#elif defined(ARTD_CULL_SSE2)
+            for(int half = 0; half < BlockSize; half += 4) {
+                size_t at = base + half;
+                __m128 x = _mm_loadu_ps(xs + at);
+                __m128 y = _mm_loadu_ps(ys + at);
+                __m128 z = _mm_loadu_ps(zs + at);
+                __m128 negR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(rs + at));
+                __m128 out = _mm_setzero_ps();
+                for(int p = 0; p < 6; ++p) {
+                    const float *pl = planes_[p];
+                    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[0]), x),
+                                                     _mm_mul_ps(_mm_set1_ps(pl[1]), y)),
+                                          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[2]), z),
+                                                     _mm_set1_ps(pl[3])));
+                    out = _mm_or_ps(out, _mm_cmplt_ps(d, negR));
+                }
+                outside |= (uint32_t)_mm_movemask_ps(out) << half;
+            }
+#else
+            for(int i = 0; i < BlockSize; ++i) {
+                size_t at = base + i;
+                for(int p = 0; p < 6; ++p) {
+                    const float *pl = planes_[p];
+                    if(pl[0] * xs[at] + pl[1] * ys[at] + pl[2] * zs[at] + pl[3] < -rs[at]) {
+                        outside |= 1u << i;
+                        break;
+                    }
+                }
+            }
+#endif
+            size_t end = count - base < (size_t)BlockSize ? count - base : (size_t)BlockSize;
+            for(size_t i = 0; i < end; ++i) {
+                if(!(outside & (1u << i)) && !boxOutside(base + i)) {
+                    visible.push_back(items_[base + i]);
+                }
+            }
+        }
+    }
+};
+
+#undef INL
+
+ARTD_END
@@ -1,8 +1,14 @@
 #include "GpuEngineImpl.h"
 #include "artd/GpuBufferManager.h"
 #include "artd/pointer_math.h"
+#include "artd/Mutex.h"
+#include "./ChunkAllocator.h"
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 ARTD_BEGIN
 
@@ -14,21 +20,36 @@ ARTD_BEGIN
 // something like it is:  https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator
 
 
-#define INL ARTD_ALWAYS_INLINE
-// #define MIX_BUFFER_TYPES
 
 #define INL ARTD_ALWAYS_INLINE
 
-static const int maxBuffSize = 0x7FFFFF;
+static const uint32_t initialUploadSlotSize = 0x10000;
+static const int createBufferWaitMillis = 5000;  // for a loader thread waiting on the render thread
 
 BufferChunk::~BufferChunk() {
 }
 
+class BatchRecord {
+public:
+    ObjectPtr<BufferChunk> dest;  // resolved when flushed as it may be moved
+    uint64_t srcOffset;
+    uint64_t size;
+};
+
+// an upload batch being built up on a thread
+class UploadBatchData {
+public:
+    int depth_ = 0;
+    uint64_t fence_ = 0;
+    std::vector<uint8_t> data_;
+    std::vector<BatchRecord> records_;
+};
+
+static thread_local UploadBatchData threadUploadBatch;
+
 class ARTD_API_GPU_ENGINE GpuBufferManagerImpl
     : public GpuBufferManager
 {
-    class ManagedGpuBuffer;
-    
     class BufferChunkImpl
         : public BufferChunk
     {
@@ -43,367 +64,415 @@ class ARTD_API_GPU_ENGINE GpuBufferManagerImpl
         
         ~BufferChunkImpl() {
             if(parent_) {
-                getParent()->removePiece(this);
+                ChunkAllocatorT::releasePiece(this);
                 parent_ = nullptr;
             }
             size_ = 0;
         }
 
-        INL void setParent(ManagedGpuBuffer *parent) {
-            parent_ = static_cast<Buffer*>(parent);
+        INL void setParent(Buffer *parent) {
+            parent_ = parent;
         }
 
-        INL ManagedGpuBuffer *getParent() const {
-            return(static_cast<ManagedGpuBuffer*>(parent_));
+        INL Buffer *getParentBuffer() const {
+            return(parent_);
         }
 
-        INL void setStart(uint32_t start) {
-            start_ = start >> 2;
+        INL void setStart(uint64_t start) {
+            start_ = start;
         }
         
-        INL void setSize(int32_t size) {
+        INL void setSize(uint64_t size) {
             size_ = size;
         }
+
+        INL void onRelocated() {
+            ++relocations_;
+        }
+
+        INL void setBlock(RangeAllocator::Block *block) {
+            block_ = block;
+        }
+
+        INL RangeAllocator::Block *getBlock() const {
+            return(block_);
+        }
+
+        int usage_ = 0;  // as allocated
+        bool dedicated_ = false;  // asked for a buffer of its own
+    private:
+        RangeAllocator::Block *block_ = nullptr;  // range in parent buffer
     };
 
 
-    class ManagedGpuBuffer
-        : public wgpu::Buffer
+    // Supplies wgpu buffers to the ChunkAllocator and moves their contents on the GPU.
+    class GpuBackend
     {
+        GpuBufferManagerImpl &owner_;
     public:
-        // TODO: maybe we need to be able to handle buffers larger than 0x07FFFFFFF ?
-        int32_t currentEnd_ = 0; // current end of assigned (free or used) space
-        int32_t myAllocationSize_ = 0; // size this buffer is currently allocated for
-        int32_t freeSize_ = 0;  // total size of free pieces
-        int32_t maxUsed_ = 0; // max used in this buffer
-        int     usage_ = 0;
-
-        class BufferChunkCompare {
-        public:
-            INL bool operator()(BufferChunkImpl * const &a, BufferChunkImpl * const &b) const {
-                return(a->getStartOffset() < b->getStartOffset());
-            }
-        };
+        typedef Buffer BufferT;
 
-        typedef std::map < BufferChunkImpl*, BufferChunkImpl*, BufferChunkCompare> MapT;
-        MapT pieces_;
-        
-        ManagedGpuBuffer() : Buffer(nullptr) {
+        GpuBackend(GpuBufferManagerImpl &owner)
+            : owner_(owner)
+        {
         }
-        
-        ~ManagedGpuBuffer() {
-
-            AD_LOG(debug) << (void *)this <<" max used " << std::hex << maxUsed_;
 
-            for (auto itx = pieces_.begin(); itx != pieces_.end(); ++itx) {
-         //       BufferDataImpl *bd = itx->second;
-         //       bd->setParent(nullptr);
+        Buffer createBuffer(uint64_t size, int usage, bool dedicated) {
+            BufferDescriptor bufferDesc;
+            bufferDesc.label = dedicated ? "Dedicated buffer" : "Pooled buffer";
+            bufferDesc.size = ARTD_ALIGN_UP(size,16);
+            // CopySrc for compaction
+            bufferDesc.usage = dedicated ? usage : (usage | BufferUsage::CopySrc);
+            bufferDesc.mappedAtCreation = false;
+            if (owner_.onRenderThread()) {
+                return(owner_.device().createBuffer(bufferDesc));
             }
-            if (*(Buffer *)this != nullptr) {
-        //        GLuint uih = glh_;
-        //        glh_ = -1;
-        //        glDeleteBuffers(1, &uih);
+
+            // The device is only used from the render thread so a loader thread waits
+            // for it to make the buffer. This only happens when a pool is full.
+            class Request {
+            public:
+                BufferDescriptor desc;
+                Buffer buffer = nullptr;
+                std::atomic<int> state{0};  // 1 made, 2 given up on
+                WaitableSignal done;
+            };
+            auto request = std::make_shared<Request>();
+            request->desc = bufferDesc;
+            owner_.owner_.updateQueue_->postEvent(&owner_, [request](void *arg) {
+                GpuBufferManagerImpl *manager = static_cast<GpuBufferManagerImpl*>(arg);
+                request->buffer = manager->device().createBuffer(request->desc);
+                if (request->state.exchange(1) == 2) {
+                    manager->disposeBuffer(request->buffer);
+                }
+                request->done.signal();
+                return(false);
+            });
+            request->done.waitOnSignal(createBufferWaitMillis);
+            if (request->state.exchange(2) != 1) {
+                AD_LOG(error) << "timed out waiting for the render thread to create a buffer";
+                return(nullptr);
             }
-            pieces_.clear();
+            return(request->buffer);
         }
 
-        bool canBeType(int usage) {
-            return((usage_ & usage) == usage);
-        }
-        INL void setUsage(int usage) {
-            usage_ = usage;
-        }
-        INL BufferUsageFlags getUsage() {
-            return(usage_);
-        }
-        INL Buffer getBuffer() {
-            return(*this);
-        }
-        INL void setBuffer(Buffer b) {
-            *(Buffer*)this = b;
+        void releaseBuffer(Buffer &buf) {
+            if (owner_.onRenderThread()) {
+                owner_.disposeBuffer(buf);
+                return;
+            }
+            Buffer toFree = buf;
+            buf = nullptr;
+            owner_.owner_.updateQueue_->postEvent(&owner_, [toFree](void *arg) mutable {
+                static_cast<GpuBufferManagerImpl*>(arg)->disposeBuffer(toFree);
+                return(false);
+            });
         }
-        INL void setMyAllocationSize(int32_t allocSize) {
-            myAllocationSize_ = allocSize;
+
+        uint64_t maxBufferSize() {
+            return(owner_.owner_.deviceLimits().maxBufferSize);
         }
 
-        INL void addPiece(BufferChunkImpl *piece) {
-            piece->setParent(this);
-            pieces_[piece] = piece;
+        uint32_t alignment(int usage) const {
+            // these may be bound at an offset
+            const Limits &limits = owner_.owner_.deviceLimits();
+            if (usage & BufferUsage::Uniform) {
+                return(limits.minUniformBufferOffsetAlignment);
+            }
+            if (usage & BufferUsage::Storage) {
+                return(limits.minStorageBufferOffsetAlignment);
+            }
+            if (usage & BufferUsage::Vertex) {
+                // whole vertices so a chunk's offset can be a draw's base vertex,
+                // the allocator rounds offsets up to a power of two alignment
+                static_assert((sizeof(GpuVertexAttributes) & (sizeof(GpuVertexAttributes) - 1)) == 0);
+                return(sizeof(GpuVertexAttributes));
+            }
+            return(4);
         }
-        INL uint32_t alignedSize(uint32_t size) const {
-            return((usage_ & BufferUsage::Uniform) ? ARTD_ALIGN_UP(size, 16) : ARTD_ALIGN_UP(size, 4));
+
+        // Not while a frame is being staged, the copies staged so far would land on
+        // ranges given to other chunks.  It is then scheduled for before the next frame.
+        bool canCompactNow() {
+            return(owner_.onRenderThread() && !owner_.uploadRing_.frameOpen_);
         }
 
-        INL int64_t getEndOffset(BufferChunkImpl *piece) const {
-            return(piece->getStartOffset() + alignedSize(piece->getSize()));
+        void scheduleCompaction() {
+            // done on the update queue so it is before the next frame is encoded.
+            owner_.owner_.updateQueue_->postEvent(&owner_, [](void *arg) {
+                static_cast<GpuBufferManagerImpl*>(arg)->runCompactionPasses();
+                return(false);
+            });
         }
-        
 
-        //       void allocOrReallocPiece(BufferDataImpl *piece, int newSize);
+        // Moved pieces are packed into a work buffer and copied back in one go
+        // as copyBufferToBuffer() can not copy within the same buffer.  As everything
+        // past the first hole moves they all land contiguously from the first move's target.
+        // Anything that bakes in a chunk offset (ie: bind groups) checks getRelocationCount()
+        void moveRanges(Buffer &buf, const RangeMove *moves, int count) {
 
-        INL int32_t availableNow() {
-            return(myAllocationSize_ - currentEnd_);
-        }
-        INL int32_t available() {
-            return((myAllocationSize_ - currentEnd_) + freeSize_);
+            uint64_t toMove = 0;
+            for(int i = 0; i < count; ++i) {
+                toMove += moves[i].size;
+            }
+
+            BufferDescriptor workDesc;
+            workDesc.label = "Compaction work buffer";
+            workDesc.size = ARTD_ALIGN_UP(toMove, 16);
+            workDesc.usage = BufferUsage::CopySrc | BufferUsage::CopyDst;
+            workDesc.mappedAtCreation = false;
+            Buffer work = owner_.device().createBuffer(workDesc);
+
+            CommandEncoderDescriptor encoderDesc;
+            encoderDesc.label = "Compaction encoder";
+            CommandEncoder encoder = owner_.device().createCommandEncoder(encoderDesc);
+
+            uint64_t workEnd = 0;
+            for(int i = 0; i < count; ++i) {
+                encoder.copyBufferToBuffer(buf, moves[i].from, work, workEnd, moves[i].size);
+                workEnd += moves[i].size;
+            }
+            encoder.copyBufferToBuffer(work, 0, buf, moves[0].to, workEnd);
+
+            CommandBufferDescriptor cmdBufferDesc;
+            cmdBufferDesc.label = "Compaction commands";
+            CommandBuffer command = encoder.finish(cmdBufferDesc);
+            owner_.owner_.queue.submit(command);
+            command.release();
+            encoder.release();
+            work.release();  // freed when the copies are done
+
+            ++owner_.relocations_;
         }
+    };
 
-    private:
-        friend class GpuBufferManagerImpl;
+    typedef ChunkAllocator<GpuBackend, BufferChunkImpl> ChunkAllocatorT;
+
+    // Staging ring for per frame uploads with a slot for each frame in flight.
+    // A frame's data is packed into a persistently mapped staging buffer and copied to
+    // the destination chunks in the frame's command buffer. After the frame is submitted
+    // the slot is re-mapped, and is reused when the map completes, which is after the GPU is
+    // done with it.  If no slot is ready yet data goes through a scratch buffer and
+    // queue.writeBuffer() rather than stalling.
+    class FrameUploadRing
+    {
+    public:
+        static const int FramesInFlight = 3;
+
+        class Slot {
+        public:
+            Buffer buffer_ = nullptr;
+            uint32_t size_ = 0;
+            uint8_t *mapped_ = nullptr;  // non null when ready to write into
+            bool mapPending_ = false;
+            std::unique_ptr<BufferMapCallback> mapCallback_;
+        };
 
-        int32_t firstFreeOffset_ = std::numeric_limits<int>::max();
-        bool compactionScheduled_ = false;
+        class Record {
+        public:
+            ObjectPtr<BufferChunk> dest;  // resolved when flushed as it may be moved
+            uint32_t destOffset;  // in dest
+            uint32_t srcOffset;
+            uint32_t size;
+            bool fromScratch;
+        };
 
-        INL bool compactionScheduled() const {
-            return(compactionScheduled_);
+        GpuBufferManagerImpl &owner_;
+        Slot slots_[FramesInFlight];
+        int current_ = 0;
+        Slot *active_ = nullptr;  // slot being filled this frame, null if all busy
+        bool frameOpen_ = false;
+        uint32_t used_ = 0;
+        uint32_t neededSize_ = initialUploadSlotSize;
+
+        std::vector<uint8_t> scratch_;
+        uint32_t scratchUsed_ = 0;
+        std::vector<Record> records_;
+
+        FrameUploadRing(GpuBufferManagerImpl &owner)
+            : owner_(owner)
+        {
         }
 
-        void scheduleCompaction() {
-            if (!compactionScheduled_) {
-                compactionScheduled_ = true;
-//                UIEngineImpl::runOnUIThread([&](GraphicsContext &gc) {
-//                    if (compactionScheduled_) {
-//                        compactPieces();
-//                    }
-//                    return(false);
-//                }, true);
-            }
+        void createSlot(Slot &slot) {
+            owner_.disposeBuffer(slot.buffer_);
+
+            BufferDescriptor bufferDesc;
+            bufferDesc.label = "Frame upload slot";
+            bufferDesc.size = neededSize_;
+            bufferDesc.usage = BufferUsage::MapWrite | BufferUsage::CopySrc;
+            bufferDesc.mappedAtCreation = true;
+            slot.buffer_ = owner_.device().createBuffer(bufferDesc);
+            slot.size_ = neededSize_;
+            slot.mapped_ = (uint8_t *)slot.buffer_.getMappedRange(0, slot.size_);
+            slot.mapPending_ = false;
         }
 
-        void allocOrReallocPiece(BufferChunkImpl *piece, int newSize) {
-        
-            ManagedGpuBuffer *parent = piece->getParent();
-            if (parent) {
-                parent->removePiece(piece);
-            }
-        
-            // align size for useage
-            int allocSize = alignedSize(newSize);
-            piece->setStart((uint32_t)currentEnd_);
-            currentEnd_ += allocSize;
-            if (currentEnd_ > maxUsed_) {
-                maxUsed_ = currentEnd_;
+        void openFrame() {
+            frameOpen_ = true;
+            used_ = 0;
+            scratchUsed_ = 0;
+            records_.clear();
+            active_ = nullptr;
+
+            for(int i = 0; i < FramesInFlight; ++i) {
+                int ix = (current_ + i) % FramesInFlight;
+                Slot &slot = slots_[ix];
+                if (slot.mapPending_) {
+                    continue;
+                }
+                // new, failed to map, or too small last time around
+                if (!slot.mapped_ || slot.size_ < neededSize_) {
+                    createSlot(slot);
+                }
+                current_ = ix;
+                active_ = &slot;
+                break;
             }
-            piece->setSize((uint32_t)allocSize);
-            addPiece(piece);
         }
 
-        void removePiece(BufferChunkImpl *piece) {
-        
-            if (getEndOffset(piece) == currentEnd_) {
-                // TODO: 64 bit ?
-                currentEnd_ = (int32_t)piece->getStartOffset();
-                // TODO: remove any free space below end if present.
+        void *stage(const ObjectPtr<BufferChunk> &dest, uint32_t destOffset, uint32_t size) {
+
+            if (((uint64_t)destOffset + size) > dest->getSize()) {
+                AD_LOG(error) << "upload past end of chunk " << std::hex << (destOffset + size);
+                return(nullptr);
+            }
+            if (!frameOpen_) {
+                openFrame();
             }
-            else
-            {
-                freeSize_ += piece->getSize();  // TODO: should this be aligned size ??
-                /*
-                LOGDEBUG("\n\n\n       %p removing piece at %d freeSize %d oldFree %d", this, piece->getStartOffset(), freeSize_, firstFreeOffset_);
-                for (auto itx = pieces_.begin(); itx != pieces_.end(); ++itx) {
-                    BufferDataImpl *bd = itx->second;
-                    LOGDEBUG("after     %d[%d] end %d", bd->getStartOffset(), bd->getSize(), bd->getEndOffset());
+
+            uint32_t copySize = ARTD_ALIGN_UP(size, 4);
+            uint32_t stride = ARTD_ALIGN_UP(size, 16);
+            uint32_t srcOffset;
+            uint8_t *ret;
+            bool fromScratch = false;
+
+            if (active_ && (used_ + stride) <= active_->size_) {
+                srcOffset = used_;
+                ret = active_->mapped_ + used_;
+                used_ += stride;
+            } else {
+                // make the slot big enough for this next time around
+                uint32_t frameBytes = used_ + scratchUsed_ + stride;
+                while (neededSize_ < frameBytes) {
+                    neededSize_ <<= 1;
                 }
-                */
-        
-                if (((int32_t)piece->getStartOffset()) < firstFreeOffset_) {
-                    firstFreeOffset_ = (int32_t)piece->getStartOffset();
+                if (scratch_.size() < (scratchUsed_ + stride)) {
+                    scratch_.resize(std::max((size_t)(scratchUsed_ + stride), scratch_.size() * 2));
                 }
-                // LOGDEBUG("piece removed new FreeOS %d", firstFreeOffset_);
-                scheduleCompaction();
+                srcOffset = scratchUsed_;
+                ret = scratch_.data() + scratchUsed_;
+                scratchUsed_ += stride;
+                fromScratch = true;
             }
-            pieces_.erase(piece);
-            /*
-            for (auto itx = pieces_.begin(); itx != pieces_.end(); ++itx) {
-                BufferDataImpl *bd = itx->second;
-                LOGDEBUG("after     %d[%d] end %d", bd->getStartOffset(), bd->getSize(), bd->getEndOffset());
+
+            // coalesce with the last copy if contiguous on both ends
+            if (!records_.empty()) {
+                Record &last = records_.back();
+                if (last.fromScratch == fromScratch
+                    && last.dest.get() == dest.get()
+                    && (last.srcOffset + last.size) == srcOffset
+                    && (last.destOffset + last.size) == destOffset)
+                {
+                    last.size += copySize;
+                    return(ret);
+                }
             }
-            */
-            piece->setParent(nullptr);
-            piece->setSize(0);
-            // LOGDEBUG("\n\n\n");
+            records_.push_back({ dest, destOffset, srcOffset, copySize, fromScratch });
+            return(ret);
         }
 
+        void flush(CommandEncoder &encoder) {
+            if (!frameOpen_) {
+                return;
+            }
+            if (active_) {
+                active_->buffer_.unmap();
+                active_->mapped_ = nullptr;
+            }
+            for(const Record &r : records_) {
+                // freed before the frame was flushed
+                if (!(*r.dest)) {
+                    continue;
+                }
+                Buffer destBuf = r.dest->getBuffer();
+                uint64_t destStart = r.dest->getStartOffset() + r.destOffset;
+                if (r.fromScratch) {
+                    owner_.owner_.queue.writeBuffer(destBuf, destStart, scratch_.data() + r.srcOffset, r.size);
+                } else {
+                    encoder.copyBufferToBuffer(active_->buffer_, r.srcOffset, destBuf, destStart, r.size);
+                }
+            }
+            records_.clear();
+        }
 
-        void compactPieces() {
+        void onSubmitted() {
+            if (!frameOpen_) {
+                return;
+            }
+            frameOpen_ = false;
+            if (active_) {
+                Slot *slot = active_;
+                slot->mapPending_ = true;
+                slot->mapCallback_ = slot->buffer_.mapAsync(MapMode::Write, 0, slot->size_, [slot](BufferMapAsyncStatus status) {
+                    slot->mapPending_ = false;
+                    if (status == BufferMapAsyncStatus::Success) {
+                        slot->mapped_ = (uint8_t *)slot->buffer_.getMappedRange(0, slot->size_);
+                    }
+                });
+                active_ = nullptr;
+                current_ = (current_ + 1) % FramesInFlight;
+            }
+        }
 
-            compactionScheduled_ = false;
-        
-//            // LOGDEBUG("\n\n");
-//        
-//            MapT::iterator it;
-//        
-//            std::vector<BufferDataImpl *> testPieces;
-//        
-//            if (firstFreeOffset_ == 0) {
-//                if (pieces_.empty()) {
-//                    currentEnd_ = 0;
-//                    freeSize_ = 0;
-//                    firstFreeOffset_ = std::numeric_limits<int>::max();
-//                    return;
-//                }
-//                it = pieces_.begin();
-//            }
-//            else {
-//        
-//        #ifdef TESTING_COMPACTOR
-//                int testSize = 0;
-//                BufferDataImpl *pbd;
-//        
-//                for (int i = 1; i < 9; ++i) {
-//                    pbd = new BufferDataImpl();
-//                    allocOrReallocPiece(pbd, i * 4);
-//                    testPieces.push_back(pbd);
-//                }
-//        
-//                removePiece(testPieces[0]);
-//                removePiece(testPieces[2]);
-//                removePiece(testPieces[3]);
-//                removePiece(testPieces[7]);
-//        
-//                if (this->freeSize_ == 0) {
-//                    return;
-//                }
-//        #endif
-//        
-//                BufferChunkImpl bd;
-//                bd.setStart(firstFreeOffset_);
-//                it = pieces_.lower_bound(&bd);
-//                if (it == pieces_.end()) {
-//                    if (pieces_.empty() || (freeSize_ == 0)) {
-//                        currentEnd_ = 0;
-//                        freeSize_ = 0;
-//                        firstFreeOffset_ = std::numeric_limits<int>::max();
-//                        return;
-//                    }
-//                    --it;
-//                    if (it->second->getEndOffset() <= firstFreeOffset_) {
-//                        currentEnd_ = it->second->getEndOffset();
-//                        freeSize_ = 0;
-//                        firstFreeOffset_ = std::numeric_limits<int>::max();
-//                        return;
-//                    }
-//                }
-//            }
-//        
-//        
-//        #ifdef TESTING_COMPACTOR
-//            LOGDEBUG("     first free %d freeSize %d end %d", firstFreeOffset_, freeSize_, currentEnd_);
-//        
-//            for (auto itx = pieces_.begin(); itx != pieces_.end(); ++itx) {
-//                BufferDataImpl *bd = itx->second;
-//                LOGDEBUG("     %d[%d]", bd->getStartOffset(), bd->getSize());
-//            }
-//        #endif
-//        
-//            // create a work buffer for compacting data.
-//            GLuint workBuffer;
-//    //        glGenBuffers(1, &workBuffer);
-//    //        glBindBuffer(type_,workBuffer); // note must be of same type as buffers being copied
-//    //        glBufferData(type_, currentEnd_ - (firstFreeOffset_ + freeSize_), NULL, GL_STATIC_DRAW);
-//    //        glBindBuffer(GL_COPY_WRITE_BUFFER, workBuffer);
-//    //        glBindBuffer(GL_COPY_READ_BUFFER, getGLH());
-//        
-//            currentEnd_ = firstFreeOffset_;
-//            int lastEnd = firstFreeOffset_;
-//            int appendStart = 0;
-//        
-//            int blockSize = 0;
-//            int blockStart = 0;
-//            bool afterGap = false;
-//        
-//            MapT::iterator nextIt = it;
-//            for (;; it=nextIt) {
-//                ++nextIt;
-//                BufferChunkImpl *bd = it->second;
-//        
-//                // see if there is a gap from prior piece ( free space )
-//                if (lastEnd < bd->getStartOffset()) {
-//        
-//                    lastEnd = bd->getEndOffset();
-//                    if(!afterGap) {
-//                        afterGap = true;
-//                    }
-//                    else if (blockSize > 0) {   // encountered a second gap after a continguous block
-//                        // copy the accumulated block to the compacted buffer
-//                        // if(type_ == GL_ELEMENT_ARRAY_BUFFER) LOGDEBUG("copy %d to %d", blockSize, appendStart);
-//        
-////                        glCopyBufferSubData(GL_COPY_READ_BUFFER,
-////                            GL_COPY_WRITE_BUFFER,
-////                            blockStart,
-////                            appendStart,
-////                            blockSize);
-//        
-//                        appendStart += blockSize;
-//                        blockSize = 0;
-//                    }
-//                    blockStart = bd->getStartOffset();
-//                }
-//                // set to new starting offset and advance to next
-//                bd->setStart(currentEnd_);
-//                currentEnd_ = bd->getEndOffset();
-//        
-//                // append size to block to copy on next gap
-//                if(afterGap) {
-//                    blockSize += bd->getSize();
-//                }
-//        
-//                if (nextIt == pieces_.end()) {
-//                    // if a lingering last block copy it.
-//                    if (blockSize > 0) {
-//                        // if(type_ == GL_ELEMENT_ARRAY_BUFFER) LOGDEBUG("copy %d to %d", blockSize, appendStart);
-//        
-////                        glCopyBufferSubData(GL_COPY_READ_BUFFER,
-////                            GL_COPY_WRITE_BUFFER,
-////                            blockStart,
-////                            appendStart,
-////                            blockSize);
-//        
-//                        appendStart += blockSize;
-//                    }
-//                    break; // done
-//                }
-//            }
-//        
-//            // copy any compacted data back to the original buffer
-//            if (appendStart > 0) {
-////                glBindBuffer(GL_COPY_WRITE_BUFFER, getGLH());
-////                glBindBuffer(GL_COPY_READ_BUFFER, workBuffer);
-////
-////                // if(type_ == GL_ELEMENT_ARRAY_BUFFER) LOGDEBUG("copy %d to %d", blockSize, appendStart);
-////
-////                glCopyBufferSubData(GL_COPY_READ_BUFFER,
-////                    GL_COPY_WRITE_BUFFER,
-////                    0,
-////                    firstFreeOffset_,
-////                    appendStart);
-//            }
-//        
-////            glBindBuffer(GL_COPY_WRITE_BUFFER,0);
-////            glBindBuffer(GL_COPY_READ_BUFFER,0);
-////            glBindBuffer(type_,0);
-//        
-//            freeSize_ = 0;
-//            firstFreeOffset_ = std::numeric_limits<int>::max();
-//        
-////            glDeleteBuffers(1, &workBuffer); // done with temp buffer
-//        
-//        #ifdef TESTING_COMPACTOR
-//            for (auto itx = pieces_.begin(); itx != pieces_.end(); ++itx) {
-//                BufferChunkImpl *bd = itx->second;
-//                AD_LOG(debug) << "after " << bd->getStart() << "[" << bd->getSize() << "] end " <<%d", bd->getEndOffset();
-//            }
-//            AD_LOG(debug) << "\n\n";
-//        
-//            currentEnd_ = 0;
-//            pieces_.clear();
-//        #endif
+        void shutdown() {
+            for(Slot &slot : slots_) {
+                owner_.disposeBuffer(slot.buffer_);
+                slot.mapped_ = nullptr;
+                slot.mapCallback_ = nullptr;
+            }
+            records_.clear();
+            frameOpen_ = false;
+            active_ = nullptr;
         }
+    };
+
+    FrameUploadRing uploadRing_;
 
+    // a submitted batch's staging buffer, mapped again when the GPU is done with it.
+    class PendingBatch {
+    public:
+        Buffer staging_ = nullptr;
+        bool done_ = false;
+        std::unique_ptr<BufferMapCallback> doneCallback_;
     };
 
-    
-    std::vector<ManagedGpuBuffer*> gpuBuffers_;
+    std::vector<std::unique_ptr<PendingBatch>> pendingBatches_;
+
+    // fences of batches begun and not yet done with by the GPU
+    Mutex fenceLock_;
+    uint64_t lastUploadFence_ = 0;
+    std::set<uint64_t> openFences_;
+
+    // Chunks are allocated from shards by usage type, each with its own lock, so
+    // loader threads can allocate concurrently.  The device is only used from the
+    // render thread, other threads stage their data in upload batches which are
+    // published on the render thread.
+    static const int ShardCount = 5;  // index, vertex, uniform, storage, other
+    bool geometryMegabuffer_ = true;
+
+    GpuBackend backend_;
+    std::unique_ptr<ChunkAllocatorT> shards_[ShardCount];
+    std::atomic<std::thread::id> renderThread_;
+
+    std::atomic<uint64_t> frameUploadBytes_{0};
+    uint64_t lastFrameUploadBytes_ = 0;
+    uint64_t totalUploadBytes_ = 0;
+
+    // snapshot read by getBufferStats()
+    Mutex statsLock_;
+    std::vector<GpuBufferStats> bufferStats_;
+    GpuBufferStats totalStats_ = GpuBufferStats();
 
     INL Device device() {
         return(owner_.device_);
@@ -417,39 +486,204 @@ class ARTD_API_GPU_ENGINE GpuBufferManagerImpl
         }
     }
 
+    INL bool onRenderThread() const {
+        return(std::this_thread::get_id() == renderThread_.load());
+    }
+
+    INL ChunkAllocatorT &shardFor(int usage) {
+        int ix = (usage & BufferUsage::Index) ? 0
+               : (usage & BufferUsage::Vertex) ? 1
+               : (usage & BufferUsage::Uniform) ? 2
+               : (usage & BufferUsage::Storage) ? 3 : 4;
+        return(*shards_[ix]);
+    }
+
+    void runCompactionPasses() {
+        for(auto &shard : shards_) {
+            shard->runCompactionPass();
+        }
+    }
+
+    void updateStats() {
+        synchronized(statsLock_);
+        bufferStats_.clear();
+        totalStats_ = GpuBufferStats();
+        for(auto &shard : shards_) {
+            shard->getStats(bufferStats_, totalStats_);
+        }
+        totalStats_.uploadBytesLastFrame = (int64_t)lastFrameUploadBytes_;
+        totalStats_.uploadBytesTotal = (int64_t)totalUploadBytes_;
+    }
+
+    // write the data for a newly allocated chunk, into this thread's open batch if there is one.
+    void uploadChunkData(const ObjectPtr<BufferChunk> &chunk, const void *data, uint64_t dataSize) {
+
+        UploadBatchData &batch = threadUploadBatch;
+        if (batch.depth_ == 0) {
+            if (onRenderThread()) {
+                frameUploadBytes_ += dataSize;
+                // writes are in multiples of 4 bytes, the chunk's size may be larger
+                uint64_t size = ARTD_ALIGN_UP(dataSize, 4);
+                if (size == dataSize) {
+                    owner_.queue.writeBuffer(chunk->getBuffer(), chunk->getStartOffset(), data, size);
+                } else {
+                    std::vector<uint8_t> padded(size, 0);
+                    ::memcpy(padded.data(), data, dataSize);
+                    owner_.queue.writeBuffer(chunk->getBuffer(), chunk->getStartOffset(), padded.data(), size);
+                }
+                return;
+            }
+            // other threads can't use the queue, it goes through a batch of its own.
+            beginUploadBatch();
+            uploadChunkData(chunk, data, dataSize);
+            endUploadBatch();
+            return;
+        }
+        frameUploadBytes_ += dataSize;
+        uint64_t at = batch.data_.size();
+        uint64_t size = ARTD_ALIGN_UP(dataSize, 4);
+        batch.data_.resize(at + size, 0);
+        ::memcpy(batch.data_.data() + at, data, dataSize);
+        batch.records_.push_back({ chunk, at, size });
+    }
+
+    uint64_t openUploadFence() {
+        synchronized(fenceLock_);
+        uint64_t fence = ++lastUploadFence_;
+        openFences_.insert(fence);
+        return(fence);
+    }
+
+    void closeUploadFence(uint64_t fence) {
+        synchronized(fenceLock_);
+        openFences_.erase(fence);
+    }
+
+    // Every fence up to the oldest still open is complete. Only done on the render
+    // thread as that is where completedUploadFence_ is read.
+    void updateCompletedFence() {
+        synchronized(fenceLock_);
+        completedUploadFence_ = openFences_.empty() ? lastUploadFence_ : (*openFences_.begin() - 1);
+    }
+
+    // on the render thread
+    void flushUploadBatch(UploadBatchData &data) {
+
+        if (data.records_.empty()) {
+            closeUploadFence(data.fence_);
+            updateCompletedFence();
+            return;
+        }
+
+        auto batch = std::make_unique<PendingBatch>();
+
+        BufferDescriptor stagingDesc;
+        stagingDesc.label = "Upload batch staging";
+        stagingDesc.size = data.data_.size();
+        stagingDesc.usage = BufferUsage::MapWrite | BufferUsage::CopySrc;
+        stagingDesc.mappedAtCreation = true;
+        Buffer staging = device().createBuffer(stagingDesc);
+        ::memcpy(staging.getMappedRange(0, data.data_.size()), data.data_.data(), data.data_.size());
+        staging.unmap();
+
+        CommandEncoderDescriptor encoderDesc;
+        encoderDesc.label = "Upload batch encoder";
+        CommandEncoder encoder = device().createCommandEncoder(encoderDesc);
+
+        for(const BatchRecord &r : data.records_) {
+            // freed before the batch was flushed
+            if (!(*r.dest)) {
+                continue;
+            }
+            uint64_t size = std::min(r.size, (uint64_t)ARTD_ALIGN_UP(r.dest->getSize(), 4));
+            encoder.copyBufferToBuffer(staging, r.srcOffset, r.dest->getBuffer(), r.dest->getStartOffset(), size);
+        }
+
+        CommandBufferDescriptor cmdBufferDesc;
+        cmdBufferDesc.label = "Upload batch commands";
+        CommandBuffer command = encoder.finish(cmdBufferDesc);
+        owner_.queue.submit(command);
+        command.release();
+        encoder.release();
+
+        // draws are submitted after it on the same queue so the data is there for them
+        closeUploadFence(data.fence_);
+        updateCompletedFence();
+
+        PendingBatch *pb = batch.get();
+        pb->staging_ = staging;
+        pb->doneCallback_ = staging.mapAsync(MapMode::Write, 0, data.data_.size(), [pb](BufferMapAsyncStatus) {
+            pb->done_ = true;
+        });
+        pendingBatches_.push_back(std::move(batch));
+
+        data.records_.clear();
+        data.data_.clear();
+    }
+
+    // release the staging for batches the GPU is done with
+    void retireUploadBatches() {
+        for(size_t i = 0; i < pendingBatches_.size();) {
+            PendingBatch &pb = *pendingBatches_[i];
+            if (!pb.done_) {
+                ++i;
+                continue;
+            }
+            disposeBuffer(pb.staging_);
+            pendingBatches_.erase(pendingBatches_.begin() + i);
+        }
+        updateCompletedFence();
+    }
+
 public:
     GpuBufferManagerImpl(GpuEngineImpl *owner)
         : GpuBufferManager(owner)
+        , uploadRing_(*this)
+        , backend_(*this)
+        , renderThread_(std::this_thread::get_id())
     {
+        for(auto &shard : shards_) {
+            shard.reset(new ChunkAllocatorT(backend_));
+        }
     }
     ~GpuBufferManagerImpl() {
         AD_LOG(info) << "killing buffer manager";
 
     }
-    virtual void shutdown() override {
-        AD_LOG(info) << "shutting down!";
+    void onDeviceCreated() override {
+        const GpuEngineImpl::DeviceProfile &dp = owner_.deviceProfile();
+        for(auto &shard : shards_) {
+            shard->setSizes(dp.bufferPoolSize, dp.dedicatedBufferThreshold);
+        }
+        setGeometryMegabuffer(geometryMegabuffer_);
     }
 
-    ManagedGpuBuffer *
-    createManagedBuffer(int size, BufferUsageFlags usage) {
-
-        BufferDescriptor bufferDesc;
-
-        bufferDesc.size = ARTD_ALIGN_UP(size,16);
-        bufferDesc.usage = usage;
-        bufferDesc.mappedAtCreation = false;
-
-        Buffer buf = device().createBuffer(bufferDesc);
+    void setGeometryMegabuffer(bool on) override {
+        geometryMegabuffer_ = on;
+        const GpuEngineImpl::DeviceProfile &dp = owner_.deviceProfile();
+        // only a mesh too big for the shared buffer gets one of its own
+        uint32_t poolSize = on ? dp.geometryBufferSize : dp.bufferPoolSize;
+        uint64_t threshold = on ? dp.geometryBufferSize : dp.dedicatedBufferThreshold;
+        shardFor(BufferUsage::Index).setSizes(poolSize, threshold);
+        shardFor(BufferUsage::Vertex).setSizes(poolSize, threshold);
+    }
 
-        auto *bb = new ManagedGpuBuffer();
-        gpuBuffers_.push_back(bb);
-        bb->setBuffer(buf);
-        bb->setUsage(usage);
-        bb->setMyAllocationSize(size);
-        return(bb);
+    virtual void shutdown() override {
+        AD_LOG(info) << "shutting down!";
+        uploadRing_.shutdown();
+        threadUploadBatch.records_.clear();
+        for(auto &pb : pendingBatches_) {
+            disposeBuffer(pb->staging_);
+            pb->doneCallback_ = nullptr;
+        }
+        pendingBatches_.clear();
+        // pieces still referenced are orphaned, their buffers are gone.
+        for(auto &shard : shards_) {
+            shard->releaseAll();
+        }
     }
 
-    void allocOrRealloc(ObjectPtr<BufferChunk> &hBc, int size, BufferUsageFlags usage) {
+    void allocOrRealloc(ObjectPtr<BufferChunk> &hBc, uint64_t size, BufferUsageFlags usage, bool dedicated = false) {
 
         ObjectPtr<BufferChunk> retBc = hBc;
         if(retBc == nullptr) {
@@ -458,71 +692,45 @@ public:
         
         BufferChunkImpl *bd = static_cast<BufferChunkImpl*>(retBc.get());
 
-        // our siszes are aligned
-        int allocSize = ARTD_ALIGN_UP(size, 4);
-        ManagedGpuBuffer *bb = bd->getParent();
-        int lastSize = bd->getSize();
-        if (lastSize < size) {
-            for (;;) {
-
-                if (bb) {
-                    if (size <= bb->available()) {
-                        if ((size - lastSize) > bb->availableNow()) {
-                            bb->removePiece(bd);
-                            if (bb->compactionScheduled()) {
-                                bb->compactPieces();
-                            }
-                        }
-                        bb->allocOrReallocPiece(bd, allocSize);
-                        hBc = retBc;
-                        return;
-                    }
-                    bb->removePiece(bd);
-                }
+        if (size == 0) {
+            return;
+        }
+        ChunkAllocatorT &shard = shardFor(usage);
+        ChunkAllocatorT *current = ChunkAllocatorT::ownerOf(bd);
+        if (current && current != &shard) {
+            ChunkAllocatorT::releasePiece(bd);
+        }
+        if (!shard.allocOrRealloc(bd, size, usage, dedicated)) {
+            AD_LOG(error) << "failed to allocate chunk of " << std::hex << size;
+            return;
+        }
+        bd->usage_ = (int)usage;
+        bd->dedicated_ = dedicated;
+        hBc = retBc;
+    }
 
-                // find a buffer if present with available space
-                ManagedGpuBuffer *found = nullptr;
-                int foundSize = std::numeric_limits<int>::max();
+    bool growChunk(ObjectPtr<BufferChunk> &chunk, uint64_t size) override {
 
-                for(int i = 0; i < (int)gpuBuffers_.size(); ++i) {
-                    ManagedGpuBuffer *glb = gpuBuffers_[i];
-                    if (glb == bb || !glb->canBeType(usage)) {
-                        continue;
-                    }
-                    int available = glb->availableNow();
-                    if (available >= allocSize) {
-                        if (available < foundSize) {
-                            found = glb;
-                            foundSize = available;
-                        }
-                    }
-                }
-                if (found) {
-                    bb = found;
-                    continue;
-                }
-                if (allocSize <= maxBuffSize) {
-                    bb = createManagedBuffer(maxBuffSize,usage);
-                    continue;
-                }
-                AD_LOG(debug) << "request too large for allocator " << std::hex << allocSize;
-            }
-            // bb->allocOrReallocPiece(bd, size);
-            return;
+        BufferChunkImpl *bd = static_cast<BufferChunkImpl*>(chunk.get());
+        if (!bd || size <= bd->getSize()) {
+            return(bd != nullptr);
         }
-        else {
-            
-            // TODO: check size and schedule compaction, or shrink size if drastically smaller.
-            if (size == 0) {
-                return;
-            }
-            hBc = retBc;
-            if (!bb) {
-                bb = gpuBuffers_[0];
-                bd->setParent(bb);
-                bd->setStart(bb->currentEnd_);
-            }
+        uint64_t maxSize = owner_.deviceLimits().maxBufferSize;
+        if (bd->usage_ & BufferUsage::Storage) {
+            maxSize = std::min<uint64_t>(maxSize, owner_.deviceLimits().maxStorageBufferBindingSize);
+        }
+        uint64_t newSize = std::min(std::max(size, bd->getSize() * 2), maxSize);
+        if (newSize < size) {
+            AD_LOG(error) << "can not grow chunk to " << std::hex << size << " past the device limit";
+            return(false);
         }
+        ObjectPtr<BufferChunk> grown;
+        allocOrRealloc(grown, newSize, (BufferUsageFlags)bd->usage_, bd->dedicated_);
+        if (!grown) {
+            return(false);
+        }
+        chunk = grown;
+        return(true);
     }
 
     ObjectPtr<BufferChunk> allocUniformChunk(uint32_t dataSize) override {
@@ -534,28 +742,107 @@ public:
     ObjectPtr<BufferChunk> allocIndexChunk(int count, const uint16_t *data) override {
 
         ObjectPtr<BufferChunk> retBc;
-        uint32_t dataSize = count * sizeof(*data);
+        uint64_t dataSize = (uint64_t)count * sizeof(*data);
         allocOrRealloc(retBc,dataSize,BufferUsage::CopyDst | BufferUsage::Index);
         if(retBc) {
-            owner_.queue.writeBuffer(retBc->getBuffer(), retBc->getStartOffset(), data, retBc->getSize());
+            uploadChunkData(retBc, data, dataSize);
         }
         return(retBc);
     }
     ObjectPtr<BufferChunk> allocVertexChunk(int count, const float *data) override {
 
         ObjectPtr<BufferChunk> retBc;
-        uint32_t dataSize = count * sizeof(*data);
+        uint64_t dataSize = (uint64_t)count * sizeof(*data);
         allocOrRealloc(retBc,dataSize,BufferUsage::CopyDst | BufferUsage::Vertex);
         if(retBc) {
-            owner_.queue.writeBuffer(retBc->getBuffer(), retBc->getStartOffset(), data, retBc->getSize());
+            uploadChunkData(retBc, data, dataSize);
         }
         return(retBc);
     }
-    ObjectPtr<BufferChunk> allocStorageChunk(uint32_t dataSize) override {
+    ObjectPtr<BufferChunk> allocStorageChunk(uint64_t dataSize) override {
         ObjectPtr<BufferChunk> retBc;
         allocOrRealloc(retBc,dataSize,BufferUsage::CopyDst | BufferUsage::Storage);
         return(retBc);
     }
+    ObjectPtr<BufferChunk> allocWritableStorageChunk(uint64_t dataSize) override {
+        ObjectPtr<BufferChunk> retBc;
+        allocOrRealloc(retBc,dataSize,BufferUsage::CopyDst | BufferUsage::Storage, true);
+        return(retBc);
+    }
+    ObjectPtr<BufferChunk> allocIndirectChunk(uint64_t dataSize) override {
+        ObjectPtr<BufferChunk> retBc;
+        allocOrRealloc(retBc,dataSize,BufferUsage::CopyDst | BufferUsage::Storage | BufferUsage::Indirect, true);
+        return(retBc);
+    }
+
+    void *stageFrameUpload(const ObjectPtr<BufferChunk> &dest, uint32_t destOffset, uint32_t size) override {
+        void *ret = uploadRing_.stage(dest, destOffset, size);
+        if (ret) {
+            frameUploadBytes_ += size;
+        }
+        return(ret);
+    }
+    void beginUploadBatch() override {
+        UploadBatchData &batch = threadUploadBatch;
+        if (batch.depth_++ == 0) {
+            batch.fence_ = openUploadFence();
+        }
+    }
+    uint64_t endUploadBatch() override {
+        UploadBatchData &batch = threadUploadBatch;
+        if (batch.depth_ == 0 || --batch.depth_ > 0) {
+            return(0);
+        }
+        uint64_t fence = batch.records_.empty() ? 0 : batch.fence_;
+        if (onRenderThread()) {
+            flushUploadBatch(batch);
+            return(fence);
+        }
+        // publish it to the render thread
+        auto toFlush = std::make_shared<UploadBatchData>();
+        std::swap(*toFlush, batch);
+        owner_.updateQueue_->postEvent(this, [toFlush](void *arg) {
+            static_cast<GpuBufferManagerImpl*>(arg)->flushUploadBatch(*toFlush);
+            return(false);
+        });
+        return(fence);
+    }
+    bool isRenderThread() const override {
+        return(onRenderThread());
+    }
+    uint64_t currentUploadFence() override {
+        UploadBatchData &batch = threadUploadBatch;
+        return(batch.depth_ > 0 ? batch.fence_ : 0);
+    }
+
+    void flushFrameUploads(CommandEncoder &encoder) override {
+        renderThread_ = std::this_thread::get_id();
+        uploadRing_.flush(encoder);
+    }
+    void onFrameSubmitted() override {
+        uploadRing_.onSubmitted();
+        lastFrameUploadBytes_ = frameUploadBytes_.exchange(0);
+        totalUploadBytes_ += lastFrameUploadBytes_;
+        retireUploadBatches();
+        updateStats();
+    }
+
+    int getStatsBufferCount() override {
+        synchronized(statsLock_);
+        return((int)bufferStats_.size());
+    }
+    bool getBufferStats(int index, GpuBufferStats &stats) override {
+        synchronized(statsLock_);
+        if (index == -1) {
+            stats = totalStats_;
+            return(true);
+        }
+        if (index < 0 || index >= (int)bufferStats_.size()) {
+            return(false);
+        }
+        stats = bufferStats_[index];
+        return(true);
+    }
 
     
 };
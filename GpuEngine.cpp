@@ -45,6 +45,7 @@
 #include <string>
 #include <array>
 #include <chrono>
+#include <algorithm>
 
 #include "artd/GpuEngine-PanamaExports.h"
 #include "artd/Matrix4f.h"
@@ -54,8 +55,10 @@
 #include "artd/pointer_math.h"
 #include "./FpsMonitor.h"
 #include "./PickerPass.h"
+#include "./CullingPass.h"
 #include "./GpuErrorHandler.h"
 #include "./TextureManager.h"
+#include "./DawnBlobCache.h"
 
 ARTD_BEGIN
 
@@ -70,12 +73,22 @@ GpuEngine::~GpuEngine() {
 
 };
 
+void
+GpuEngine::setCacheDirectory(const char *path) {
+    GpuEngineImpl::getInstance().setCacheDirectory(path);
+}
+
+void
+GpuEngine::setInstanceFormat(InstanceFormat format) {
+    GpuEngineImpl::getInstance().setInstanceFormat(format);
+}
+
 ObjectPtr<GpuEngine>
-GpuEngine::createInstance(bool headless, int width, int height) {
+GpuEngine::createInstance(bool headless, int width, int height, LimitsProfile limits) {
     static ObjectPtr<GpuEngineImpl> hInstance = nullptr;
     if(hInstance.get() == nullptr) {
         GpuEngineImpl::getInstance(&hInstance);
-        /* auto ret = */ hInstance->init(headless, width, height);
+        /* auto ret = */ hInstance->init(headless, width, height, limits);
         return(hInstance);
     }
     AD_LOG(error) << "!!! you may only create one instance of the engine !!!";
@@ -106,6 +119,41 @@ GpuEngine::createMesh(const DrawableMeshDescriptor &desc) {
     return(impl().meshLoader()->createMesh(desc));
 }
 
+void
+GpuEngine::beginMeshBatch() {
+    impl().meshLoader()->beginBatch();
+}
+
+void
+GpuEngine::endMeshBatch() {
+    impl().meshLoader()->endBatch();
+}
+
+void
+GpuEngine::setIndirectDraws(bool on) {
+    impl().setIndirectDraws(on);
+}
+
+void
+GpuEngine::setGpuCulling(bool on) {
+    impl().setGpuCulling(on);
+}
+
+void
+GpuEngine::setCpuCulling(bool on) {
+    impl().setCpuCulling(on);
+}
+
+void
+GpuEngine::setEncodeThreads(int count) {
+    impl().setEncodeThreads(count);
+}
+
+void
+GpuEngine::setPipelined(bool on) {
+    impl().setPipelined(on);
+}
+
 //static void doNutin(void *addr) {
 //    if(!addr) {
 //        AD_LOG(print) << "null";
@@ -159,6 +207,7 @@ GpuEngineImpl::~GpuEngineImpl()
 }
 void
 GpuEngineImpl::releaseResources() {
+    stopSimulation();
     if(instance) {
 
         releaseDepthBuffer();
@@ -166,6 +215,11 @@ GpuEngineImpl::releaseResources() {
 
         textureManager_->shutdown();
         meshLoader_ = nullptr;
+        cullingPass_ = nullptr;
+        releaseOpaqueBundles();
+        pipelineCache_ = nullptr;
+        sceneShaders_.fill(nullptr);
+        encodeWorkers_ = nullptr;
         bufferManager_->shutdown();
 
         device_.release();
@@ -312,8 +366,91 @@ GpuEngineImpl::resizeSwapChain(int width, int height) {
     return(1);
 }
 
+// The WebGPU spec's default limits, every adapter supports at least these.
+static void setDefaultLimits(Limits &l) {
+    l.maxTextureDimension1D = 8192;
+    l.maxTextureDimension2D = 8192;
+    l.maxTextureDimension3D = 2048;
+    l.maxTextureArrayLayers = 256;
+    l.maxBindGroups = 4;
+    l.maxDynamicUniformBuffersPerPipelineLayout = 8;
+    l.maxDynamicStorageBuffersPerPipelineLayout = 4;
+    l.maxSampledTexturesPerShaderStage = 16;
+    l.maxSamplersPerShaderStage = 16;
+    l.maxStorageBuffersPerShaderStage = 8;
+    l.maxStorageTexturesPerShaderStage = 4;
+    l.maxUniformBuffersPerShaderStage = 12;
+    l.maxUniformBufferBindingSize = 0x10000;
+    l.maxStorageBufferBindingSize = 0x8000000;
+    l.minUniformBufferOffsetAlignment = 256;
+    l.minStorageBufferOffsetAlignment = 256;
+    l.maxVertexBuffers = 8;
+    l.maxBufferSize = 0x10000000;
+    l.maxVertexAttributes = 16;
+    l.maxVertexBufferArrayStride = 2048;
+    l.maxInterStageShaderComponents = 60;
+    l.maxInterStageShaderVariables = 16;
+    l.maxColorAttachments = 8;
+    l.maxComputeWorkgroupStorageSize = 16384;
+    l.maxComputeInvocationsPerWorkgroup = 256;
+    l.maxComputeWorkgroupSizeX = 256;
+    l.maxComputeWorkgroupSizeY = 256;
+    l.maxComputeWorkgroupSizeZ = 64;
+    l.maxComputeWorkgroupsPerDimension = 65535;
+}
+
+// Picks the limits to create the device with from what the adapter supports and
+// the sizes the buffer managers use with them.
+void
+GpuEngineImpl::chooseDeviceLimits(const Limits &supported, LimitsProfile profile) {
+
+    DeviceProfile &dp = deviceProfile_;
+    dp.profile = profile;
+    setDefaultLimits(dp.limits);
+
+    if(profile == LimitsMax) {
+        dp.limits = supported;
+    } else if(profile == LimitsBalanced) {
+        // counts as high as supported, sizes capped so we don't reserve silly amounts.
+        Limits caps = supported;
+        caps.maxBufferSize = std::min<uint64_t>(supported.maxBufferSize, 0x40000000);  // 1GB
+        caps.maxStorageBufferBindingSize = std::min<uint64_t>(supported.maxStorageBufferBindingSize, 0x40000000);
+        caps.maxTextureDimension1D = std::min<uint32_t>(supported.maxTextureDimension1D, 16384);
+        caps.maxTextureDimension2D = std::min<uint32_t>(supported.maxTextureDimension2D, 16384);
+        caps.maxTextureArrayLayers = std::min<uint32_t>(supported.maxTextureArrayLayers, 2048);
+        dp.limits = caps;
+    }
+    // the adapter's alignments are the smallest allowed
+    dp.limits.minUniformBufferOffsetAlignment = supported.minUniformBufferOffsetAlignment;
+    dp.limits.minStorageBufferOffsetAlignment = supported.minStorageBufferOffsetAlignment;
+
+    // the window's size may be larger than the defaults on a big monitor
+    dp.limits.maxTextureDimension1D = std::max(dp.limits.maxTextureDimension1D, std::min(height_, supported.maxTextureDimension1D));
+    dp.limits.maxTextureDimension2D = std::max(dp.limits.maxTextureDimension2D,
+                                               std::min(std::max(width_, height_), supported.maxTextureDimension2D));
+
+    static const uint32_t poolSizes[] = { 0x7FFFFF, 0x2000000, 0x8000000 };  // 8MB 32MB 128MB
+    static const uint32_t geometrySizes[] = { 0x1000000, 0x8000000, 0x10000000 };  // 16MB 128MB 256MB
+    static const uint32_t instanceCounts[] = { 128, 4096, 65536 };
+    static const uint32_t materialCounts[] = { 64, 1024, 4096 };
+    static const uint32_t lightCounts[] = { 16, 64, 256 };
+
+    dp.bufferPoolSize = (uint32_t)std::min<uint64_t>(poolSizes[profile], dp.limits.maxBufferSize);
+    dp.geometryBufferSize = (uint32_t)std::min<uint64_t>(geometrySizes[profile], dp.limits.maxBufferSize);
+    dp.dedicatedBufferThreshold = std::min<uint64_t>(0x200000ull << (2 * profile), dp.bufferPoolSize / 4);
+    dp.instanceCapacity = (uint32_t)std::min<uint64_t>(instanceCounts[profile], dp.limits.maxStorageBufferBindingSize / sizeof(InstanceData));
+    dp.materialCapacity = (uint32_t)std::min<uint64_t>(materialCounts[profile], dp.limits.maxStorageBufferBindingSize / sizeof(MaterialShaderData));
+    dp.lightCapacity = (uint32_t)std::min<uint64_t>(lightCounts[profile], dp.limits.maxStorageBufferBindingSize / sizeof(LightShaderData));
+
+    AD_LOG(info) << "device limits profile " << (int)profile
+                 << ": maxBufferSize " << dp.limits.maxBufferSize
+                 << " maxStorageBufferBindingSize " << dp.limits.maxStorageBufferBindingSize
+                 << " maxTextureDimension2D " << dp.limits.maxTextureDimension2D
+                 << " pool size " << dp.bufferPoolSize;
+}
+
 int
-GpuEngineImpl::init(bool headless, int width, int height) {
+GpuEngineImpl::init(bool headless, int width, int height, LimitsProfile limits) {
 
     {
         auto eventPool = ObjectPtr<LambdaEventQueue::LambdaEventPool>::make();
@@ -342,6 +479,9 @@ GpuEngineImpl::init(bool headless, int width, int height) {
     dawnToggles.disabledTogglesCount = 0;
     
     instanceDescriptor.nextInChain = &dawnToggles.chain;
+    if(!cacheDirectory_.empty()) {
+        dawnToggles.chain.next = dawnBlobCacheChain(cacheDirectory_);
+    }
     
     
     instance = wgpu::createInstance(instanceDescriptor);
@@ -369,43 +509,51 @@ GpuEngineImpl::init(bool headless, int width, int height) {
     adapter = instance.requestAdapter(adapterOpts);
     std::cout << "Got adapter: " << adapter << std::endl;
     
-    // specify device limits - we need to figure out a dynamic or "max" way of setting this up.
+    // device limits are picked from what the adapter supports by profile.
     SupportedLimits supportedLimits;
-    adapter.getLimits(&supportedLimits);
-    
+    if(!adapter.getLimits(&supportedLimits)) {
+        AD_LOG(error) << "could not get adapter limits, using defaults";
+        setDefaultLimits(supportedLimits.limits);
+        limits = LimitsMinimal;
+    }
+    chooseDeviceLimits(supportedLimits.limits, limits);
+
     AD_LOG(info) << "Requesting device...";
     RequiredLimits requiredLimits = Default;
-    requiredLimits.limits.maxVertexAttributes = 3;
-    //                                          ^ This was a 2
-    requiredLimits.limits.maxVertexBuffers = 1;  // max here is 8 TODO: we need the buffer namager to split these up !
-    requiredLimits.limits.maxBufferSize = 256 * sizeof(GpuVertexAttributes);
-    
-    requiredLimits.limits.maxVertexBufferArrayStride = sizeof(GpuVertexAttributes) * 2;  // cx ? does bigger hurt
+    requiredLimits.limits = deviceProfile_.limits;
     
-    requiredLimits.limits.minStorageBufferOffsetAlignment = supportedLimits.limits.minStorageBufferOffsetAlignment;
-    requiredLimits.limits.minUniformBufferOffsetAlignment = supportedLimits.limits.minUniformBufferOffsetAlignment;
-    requiredLimits.limits.maxInterStageShaderComponents = 16; // this was 3 PK
-    
-    requiredLimits.limits.maxBindGroups = 4;  // max supported seems to be 4
-    requiredLimits.limits.maxUniformBuffersPerShaderStage = 8; // 12 is max here
-    // Update max uniform buffer size:
-    requiredLimits.limits.maxUniformBufferBindingSize = 16 * 4 * sizeof(float) * 2;  // 2x added enough ?
-
-    requiredLimits.limits.maxSamplersPerShaderStage = 4; // 16 is max allowed
+    // draw groups past the first have a firstInstance, indirect draws of them are
+    // no-ops without indirect-first-instance.
+    std::vector<WGPUFeatureName> requiredFeatures;
+    indirectFirstInstance_ = adapter.hasFeature(FeatureName::IndirectFirstInstance);
+    if(indirectFirstInstance_) {
+        requiredFeatures.push_back(WGPUFeatureName_IndirectFirstInstance);
+    } else {
+        AD_LOG(info) << "adapter has no indirect-first-instance, indirect draws are off";
+    }
+    // recording draws on several threads needs Dawn to lock the device, wgpu's is
+    // always safe to share.
+#ifdef WEBGPU_BACKEND_DAWN
+    threadSafeDevice_ = adapter.hasFeature(FeatureName::ImplicitDeviceSynchronization);
+    if(threadSafeDevice_) {
+        requiredFeatures.push_back(WGPUFeatureName_ImplicitDeviceSynchronization);
+    } else {
+        AD_LOG(info) << "adapter has no implicit device synchronization, draws are recorded on one thread";
+    }
+#else
+    threadSafeDevice_ = true;
+#endif
 
-    // so is this a definition of the maximum renderer viewport size ?
-    requiredLimits.limits.maxTextureDimension1D = height_;
-    requiredLimits.limits.maxTextureDimension2D = width_;
-    requiredLimits.limits.maxTextureArrayLayers = 1;
-    
     DeviceDescriptor deviceDesc;
     deviceDesc.label = "My Device";
-    deviceDesc.requiredFeaturesCount = 0;
+    deviceDesc.requiredFeaturesCount = (uint32_t)requiredFeatures.size();
+    deviceDesc.requiredFeatures = requiredFeatures.data();
     
     deviceDesc.requiredLimits = &requiredLimits;
     deviceDesc.defaultQueue.label = "The default queue";
     device_ = adapter.requestDevice(deviceDesc);
     AD_LOG(info) << "Got device: " << device_;
+    bufferManager_->onDeviceCreated();
         
     // Add an error callback for more debug info
     errorCallback_ = GpuErrorHandler::initErrorCallback(device_);
@@ -434,106 +582,14 @@ GpuEngineImpl::init(bool headless, int width, int height) {
     pickerPass_ = ObjectPtr<PickerPass>::make(this);
     
     AD_LOG(info) << "Creating shader module...";
-    shaderModule = shaderManager_->loadShaderModule("testShader1.wgsl");
+    // the variant deciding per fragment, kept by the shader manager
+    shaderModule = sceneShaderVariant(ShaderManager::FeatureDynamic);
     AD_LOG(info)  << "Shader module: " << shaderModule;
     
-    AD_LOG(info) << "Creating render pipeline...";
-    RenderPipelineDescriptor pipelineDesc;
-    
-    std::vector<VertexAttribute> vertexAttribs(3);
-    // Position attribute
-    vertexAttribs[0].shaderLocation = 0;
-    vertexAttribs[0].format = VertexFormat::Float32x3;
-    vertexAttribs[0].offset = 0;
-    
-    // Normal attribute
-    vertexAttribs[1].shaderLocation = 1;
-    vertexAttribs[1].format = VertexFormat::Float32x3;
-    vertexAttribs[1].offset = offsetof(GpuVertexAttributes, normal);
-    
-    // UV attribute
-    vertexAttribs[2].shaderLocation = 2;
-    vertexAttribs[2].format = VertexFormat::Float32x2;
-    vertexAttribs[2].offset = offsetof(GpuVertexAttributes, uv);
-    
-    VertexBufferLayout vertexBufferLayout;
-    vertexBufferLayout.attributeCount = vertexAttribs.size();
-    vertexBufferLayout.attributes = vertexAttribs.data();
-    vertexBufferLayout.arrayStride = sizeof(GpuVertexAttributes);
-    vertexBufferLayout.stepMode = VertexStepMode::Vertex;
-    
-    pipelineDesc.vertex.bufferCount = 1;
-    pipelineDesc.vertex.buffers = &vertexBufferLayout;
-    
-    // Vertex shader
-    pipelineDesc.vertex.module = shaderModule;
-    pipelineDesc.vertex.entryPoint = "vs_main";
-    pipelineDesc.vertex.constantCount = 0;
-    pipelineDesc.vertex.constants = nullptr;
-    
-    // Each sequence of 3 vertices is considered as a triangle
-    pipelineDesc.primitive.topology = PrimitiveTopology::TriangleList;
-    // connected. When not specified, vertices are considered sequentially.
-    pipelineDesc.primitive.stripIndexFormat = IndexFormat::Undefined;
-    // The face orientation is defined by assuming that when looking
-    // from the front of the face, its corner vertices are enumerated
-    // in the counter-clockwise (CCW) order.
-    //    pipelineDesc.primitive.frontFace = FrontFace::CCW;
-    pipelineDesc.primitive.frontFace = FrontFace::CCW;  // right handed convention
-    // cull (i.e. "hide") the faces pointing away from us (which is often
-    // used for optimization).
-    pipelineDesc.primitive.cullMode = // CullMode::None;
-    CullMode::Back;  // this is for the "opaque" pass
-    
-    // Fragment shader
-    static FragmentState fragmentState;
-    pipelineDesc.fragment = &fragmentState;
-    fragmentState.module = shaderModule;
-    fragmentState.entryPoint = "fs_main";
-    fragmentState.constantCount = 0;
-    fragmentState.constants = nullptr;
-    
-    // Configure blend state
-    static BlendState blendState;
-    // Usual alpha blending for the color:
-    blendState.color.srcFactor = BlendFactor::SrcAlpha;
-    blendState.color.dstFactor = BlendFactor::OneMinusSrcAlpha;
-    blendState.color.operation = BlendOperation::Add;
-    // We leave the target alpha untouched:
-    blendState.alpha.srcFactor = BlendFactor::Zero;
-    blendState.alpha.dstFactor = BlendFactor::One;
-    blendState.alpha.operation = BlendOperation::Add;
-    
-    static ColorTargetState colorTarget;
-    
-    colorTarget.format = swapChainFormat_;
-    colorTarget.blend = &blendState;
-    colorTarget.writeMask = ColorWriteMask::All; // We could write to only some of the color channels.
-    
-    // We have only one target because our render pass has only one output color
-    // attachment.
-    fragmentState.targetCount = 1;
-    fragmentState.targets = &colorTarget;
-
-    DepthStencilState depthStencilState = Default;
-    depthStencilState.depthCompare = CompareFunction::Less;
-    depthStencilState.depthWriteEnabled = true;
-    depthStencilState.format = depthTextureFormat_;
-    depthStencilState.stencilReadMask = 0;
-    depthStencilState.stencilWriteMask = 0;
-    
-    pipelineDesc.depthStencil = &depthStencilState;
-    
-    // Multi-sampling
-    // Samples per pixel
-    pipelineDesc.multisample.count = 1;
-    pipelineDesc.multisample.mask = ~0u;
-    pipelineDesc.multisample.alphaToCoverageEnabled = false;
-    
     // Create binding layout (don't forget to = Default)
     
     // bindGroupLayout = nullptr;
-    BindGroupLayoutEntry bindingLayouts[4];
+    BindGroupLayoutEntry bindingLayouts[8];
     {
         AD_LOG(info) << "sizeof(SceneUniforms) = " << sizeof(SceneUniforms) << "  sizeof(LightData) = " << sizeof(LightShaderData);
 
@@ -541,13 +597,13 @@ GpuEngineImpl::init(bool headless, int width, int height) {
         bindingLayouts[0].binding = 0;
         bindingLayouts[0].visibility = ShaderStage::Vertex | ShaderStage::Fragment;
         bindingLayouts[0].buffer.type = BufferBindingType::Uniform;
-        bindingLayouts[0].buffer.minBindingSize = sizeof(SceneUniforms) + (SceneUniforms::MaxLights * sizeof(LightShaderData));
+        bindingLayouts[0].buffer.minBindingSize = sizeof(SceneUniforms);
         
         bindingLayouts[1] = Default;
         bindingLayouts[1].binding = 1;
         bindingLayouts[1].visibility = ShaderStage::Vertex | ShaderStage::Fragment;
         bindingLayouts[1].buffer.type = BufferBindingType::ReadOnlyStorage;
-        bindingLayouts[1].buffer.minBindingSize = sizeof(InstanceData);
+        bindingLayouts[1].buffer.minBindingSize = instanceStride();
 
         bindingLayouts[2] = Default;
         bindingLayouts[2].binding = 2;
@@ -560,13 +616,37 @@ GpuEngineImpl::init(bool headless, int width, int height) {
         bindingLayouts[3].binding = 3;
         bindingLayouts[3].visibility = ShaderStage::Fragment;
         bindingLayouts[3].sampler.type = SamplerBindingType::Filtering;
+
+        bindingLayouts[4] = Default;
+        bindingLayouts[4].binding = 4;
+        bindingLayouts[4].visibility = ShaderStage::Vertex;
+        bindingLayouts[4].buffer.type = BufferBindingType::ReadOnlyStorage;
+        bindingLayouts[4].buffer.minBindingSize = sizeof(uint32_t);
+
+        bindingLayouts[5] = Default;
+        bindingLayouts[5].binding = 5;
+        bindingLayouts[5].visibility = ShaderStage::Fragment;
+        bindingLayouts[5].buffer.type = BufferBindingType::ReadOnlyStorage;
+        bindingLayouts[5].buffer.minBindingSize = sizeof(LightShaderData);
+
+        bindingLayouts[6] = Default;
+        bindingLayouts[6].binding = 6;
+        bindingLayouts[6].visibility = ShaderStage::Fragment;
+        bindingLayouts[6].buffer.type = BufferBindingType::ReadOnlyStorage;
+        bindingLayouts[6].buffer.minBindingSize = sizeof(LightCluster);
+
+        bindingLayouts[7] = Default;
+        bindingLayouts[7].binding = 7;
+        bindingLayouts[7].visibility = ShaderStage::Fragment;
+        bindingLayouts[7].buffer.type = BufferBindingType::ReadOnlyStorage;
+        bindingLayouts[7].buffer.minBindingSize = sizeof(uint32_t);
     }
     
     // Create a bind group layout
     BindGroupLayoutDescriptor bindGroupLayoutDesc{};
-    bindGroupLayoutDesc.entryCount = 4; // todo take from data struct
+    bindGroupLayoutDesc.entryCount = 8; // todo take from data struct
     bindGroupLayoutDesc.entries =  bindingLayouts;
-    BindGroupLayout bindGroupLayout = device().createBindGroupLayout(bindGroupLayoutDesc);
+    bindGroupLayout_ = device().createBindGroupLayout(bindGroupLayoutDesc);
 
 // create bind group layout for texture !
 #ifdef WEBGPU_BACKEND_DAWN
@@ -598,7 +678,7 @@ GpuEngineImpl::init(bool headless, int width, int height) {
 
     // Create the pipeline layout
     {
-        BindGroupLayout layouts[2] { bindGroupLayout, materialBindGroupLayout  };
+        BindGroupLayout layouts[2] { bindGroupLayout_, materialBindGroupLayout  };
         
         PipelineLayoutDescriptor layoutDesc{};
         layoutDesc.bindGroupLayoutCount = 2;
@@ -608,7 +688,7 @@ GpuEngineImpl::init(bool headless, int width, int height) {
 
         // Pipeline layout
         PipelineLayout layout = device_.createPipelineLayout(layoutDesc);
-        pipelineDesc.layout = layout;
+        pipelineCache_ = ObjectPtr<PipelineCache>::make(this, layout);
     }
     
 #ifdef WEBGPU_BACKEND_DAWN
@@ -616,47 +696,34 @@ GpuEngineImpl::init(bool headless, int width, int height) {
         device_.tick();
 #endif
 
-
+    // the opaque pass pipeline, variants of it are made as materials ask for them
+    // and this one is drawn with until they are ready.
     AD_LOG(info) << "Creating Render pipeline";
-    pipeline = device_.createRenderPipeline(pipelineDesc);
-    AD_LOG(info) << "Render pipeline: " << pipeline;
+    opaqueKey_.module = shaderModule;
+    opaqueKey_.vertexLayout = PipelineKey::VertexStandard;
+    opaqueKey_.blend = PipelineKey::BlendAlpha;
+    opaqueKey_.cullMode = WGPUCullMode_Back;
+    opaqueKey_.depthCompare = WGPUCompareFunction_Less;
+    opaqueKey_.depthWrite = true;
+    opaqueKey_.colorFormat = swapChainFormat_;
+    opaqueKey_.depthFormat = depthTextureFormat_;
+    pipelineCache_->setFallback(opaqueKey_);
 
     // not really needed here first thing done when rendering a frame
 	uniforms.time = 1.0f;
 
 	// Create bindings for test objects
 	{
-        uniformBuffer_ = bufferManager_->allocUniformChunk(sizeof(SceneUniforms) + (64 * sizeof(LightShaderData)) );
-        
-        BindGroupEntry bindings[4];
-
-        {
-            BufferChunk &b = *uniformBuffer_;
-            bindings[0].binding = 0;
-            bindings[0].buffer = b.getBuffer();
-            bindings[0].offset = b.getStartOffset();
-            bindings[0].size = b.getSize();
-        }
-
-        instanceBuffer_ = bufferManager_->allocStorageChunk(128 * sizeof(InstanceData));
-
-        {
-            BufferChunk &b = *instanceBuffer_;
-            bindings[1].binding = 1;
-            bindings[1].buffer = b.getBuffer();
-            bindings[1].offset = b.getStartOffset();
-            bindings[1].size = b.getSize();
-        }
-
-        materialBuffer_ = bufferManager_->allocStorageChunk(64 * sizeof(MaterialShaderData));
-
-        {
-            BufferChunk &b = *materialBuffer_;
-            bindings[2].binding = 2;
-            bindings[2].buffer = b.getBuffer();
-            bindings[2].offset = b.getStartOffset();
-            bindings[2].size = b.getSize();
-        }
+        uniformBuffer_ = bufferManager_->allocUniformChunk(sizeof(SceneUniforms));
+        instanceBuffer_ = bufferManager_->allocStorageChunk(deviceProfile_.instanceCapacity * instanceStride());
+        materialBuffer_ = bufferManager_->allocStorageChunk(deviceProfile_.materialCapacity * sizeof(MaterialShaderData));
+        lightBuffer_ = bufferManager_->allocStorageChunk(deviceProfile_.lightCapacity * sizeof(LightShaderData));
+        indirectBuffer_ = bufferManager_->allocIndirectChunk(deviceProfile_.instanceCapacity * sizeof(DrawIndexedIndirectArgs));
+        visibleBuffer_ = bufferManager_->allocWritableStorageChunk(deviceProfile_.instanceCapacity * sizeof(uint32_t));
+        clusterBuffer_ = bufferManager_->allocStorageChunk(LightClusters::ClusterCount * sizeof(LightCluster));
+        // grown as lights reach more clusters
+        lightIndexBuffer_ = bufferManager_->allocStorageChunk(deviceProfile_.lightCapacity * 16 * sizeof(uint32_t));
+        cullingPass_ = ObjectPtr<CullingPass>::make(this);
 
         {
             // Create a sampler
@@ -671,18 +738,9 @@ GpuEngineImpl::init(bool headless, int width, int height) {
             samplerDesc.lodMaxClamp = 1.0f;
             samplerDesc.compare = CompareFunction::Undefined;
             samplerDesc.maxAnisotropy = 1;
-            Sampler sampler0_ = device_.createSampler(samplerDesc);
-
-            bindings[3].binding = 3;
-            bindings[3].sampler = sampler0_;
+            sampler0_ = device_.createSampler(samplerDesc);
         }
-
-        // A bind group contains one or multiple bindings
-        BindGroupDescriptor bindGroupDesc;
-        bindGroupDesc.layout = bindGroupLayout;
-        bindGroupDesc.entryCount = 4;
-        bindGroupDesc.entries = bindings;
-        bindGroup = device_.createBindGroup(bindGroupDesc);
+        createSceneBindGroup();
     }
 
 #ifdef WEBGPU_BACKEND_DAWN
@@ -693,7 +751,7 @@ GpuEngineImpl::init(bool headless, int width, int height) {
     // this is only for main window
 
     if(headless_) {
-        pixelGetter_ = artd::ObjectPtr<PixelReader>::make(device_, width_,height_);
+        pixelGetter_ = artd::ObjectPtr<PixelReader>::make(device_, *shaderManager_, width_,height_);
         pixelUnLockLock_.signal(); // start enabled !!
     }
 
@@ -713,6 +771,57 @@ GpuEngineImpl::init(bool headless, int width, int height) {
     return(ret);
 }
 
+// (re)create the scene bind group, needed whenever one of the chunks in it moves
+void
+GpuEngineImpl::createSceneBindGroup() {
+
+    BindGroupEntry bindings[8];
+    ObjectPtr<BufferChunk> *chunks[3] = { &uniformBuffer_, &instanceBuffer_, &materialBuffer_ };
+
+    sceneBindingsStamp_ = 0;
+    for(int i = 0; i < 3; ++i) {
+        BufferChunk &b = **chunks[i];
+        bindings[i].binding = i;
+        bindings[i].buffer = b.getBuffer();
+        bindings[i].offset = b.getStartOffset();
+        bindings[i].size = b.getSize();
+        sceneBindingsStamp_ += b.getRelocationCount();
+    }
+    bindings[3].binding = 3;
+    bindings[3].sampler = sampler0_;
+    bindings[4].binding = 4;
+    bindings[4].buffer = visibleBuffer_->getBuffer();
+    bindings[4].offset = visibleBuffer_->getStartOffset();
+    bindings[4].size = visibleBuffer_->getSize();
+    sceneBindingsStamp_ += visibleBuffer_->getRelocationCount();
+    bindings[5].binding = 5;
+    bindings[5].buffer = lightBuffer_->getBuffer();
+    bindings[5].offset = lightBuffer_->getStartOffset();
+    bindings[5].size = lightBuffer_->getSize();
+    sceneBindingsStamp_ += lightBuffer_->getRelocationCount();
+    bindings[6].binding = 6;
+    bindings[6].buffer = clusterBuffer_->getBuffer();
+    bindings[6].offset = clusterBuffer_->getStartOffset();
+    bindings[6].size = clusterBuffer_->getSize();
+    sceneBindingsStamp_ += clusterBuffer_->getRelocationCount();
+    bindings[7].binding = 7;
+    bindings[7].buffer = lightIndexBuffer_->getBuffer();
+    bindings[7].offset = lightIndexBuffer_->getStartOffset();
+    bindings[7].size = lightIndexBuffer_->getSize();
+    sceneBindingsStamp_ += lightIndexBuffer_->getRelocationCount();
+
+    if(bindGroup) {
+        bindGroup.release();
+    }
+    // A bind group contains one or multiple bindings
+    BindGroupDescriptor bindGroupDesc;
+    bindGroupDesc.layout = bindGroupLayout_;
+    bindGroupDesc.entryCount = 8;
+    bindGroupDesc.entries = bindings;
+    bindGroup = device_.createBindGroup(bindGroupDesc);
+    invalidateDrawList();
+}
+
 wgpu::BindGroup
 GpuEngineImpl::createMaterialBindGroup(Material *forM) {
 
@@ -801,15 +910,758 @@ GpuEngineImpl::processEvents() {
     }
 
     fpsMonitor_.tickFrame(timing_);
-    inputQueue_->executeEvents();
-    currentScene_->tickAnimations(timing_);
+    // when pipelined the simulation thread dispatches the input and ticks the animations
+    if(!pipelined_) {
+        inputQueue_->executeEvents();
+        currentScene_->tickAnimations(timing_);
+    }
     updateQueue_->executeEvents();
     return(true);
 }
+
+// copies what the frame renders out of the scene, on the thread that changes it.
+void
+GpuEngineImpl::captureSnapshot(SceneSnapshot &snap) {
+
+    Scene &scene = *currentScene_;
+    snap.clear();
+
+    // materials are numbered in the scene's active list order
+    int32_t matIx = 0;
+    for(auto it = scene.activeMaterials_->begin(); it != scene.activeMaterials_->end(); ++it, ++matIx) {
+        Material &mat = *it;
+        mat.setIndex(matIx);
+        snap.materials.push_back({ &mat, mat.getDataStamp(), {}, {} });
+        mat.loadShaderData(snap.materials.back().data);
+        captureMaterialState(&mat, snap.materials.back().state);
+    }
+    captureMaterialState(getDefaultMaterial().get(), snap.defaultMaterial);
+
+    std::vector<MeshNode*> &drawables = scene.drawables_;
+    for(uint32_t i = 0; i < (uint32_t)drawables.size(); ++i) {
+        MeshNode *node = drawables[i];
+        if(!node->getMesh()) {
+            continue;
+        }
+        ObjectPtr<Material> &material = node->getMaterial();
+        snap.drawables.push_back({ node, i, node->getWorldTransformAlteredCount(),
+                                   material ? material->getIndex() : 0,
+                                   node->getLocalToWorldTransform(),
+                                   node->getMeshPtr(), material, snap.defaultMaterial });
+        if(material) {
+            uint32_t ix = (uint32_t)material->getIndex();
+            if(ix < snap.materials.size() && snap.materials[ix].material == material.get()) {
+                snap.drawables.back().materialState = snap.materials[ix].state;
+            } else {
+                captureMaterialState(material.get(), snap.drawables.back().materialState);
+            }
+        }
+    }
+
+    for(LightNode *light : scene.lights_) {
+        snap.lights.push_back({ light, light->getWorldTransformAlteredCount(), light->getDataStamp(), {} });
+        light->loadShaderData(snap.lights.back().data);
+    }
+
+    auto camera = scene.currentCamera_->getCamera();
+    snap.view = camera->getView();
+    snap.projection = camera->getProjection();
+    snap.nearClip = camera->getNearClip();
+    snap.farClip = camera->getFarClip();
+    snap.eyePose = camera->getPose();
+    snap.background = scene.backgroundColor_;
+    snap.drawListVersion = scene.drawListVersion_;
+}
+
+class GpuEngineImpl::SimulationRunner
+    : public Runnable
+{
+    GpuEngineImpl &engine_;
+public:
+    SimulationRunner(GpuEngineImpl &engine)
+        : engine_(engine)
+    {}
+    void run() override {
+        engine_.simulationLoop();
+    }
+};
+
+// Simulation frame f is captured into snapshots_[f & 1], once the render thread has
+// released frame f - 2 which used that one.  The frame counters hand the snapshots
+// over, the signals only wake the waiting side.
+void
+GpuEngineImpl::simulationLoop() {
+
+    uint64_t frame = simFrames_.load();
+    while(simRunning_.load()) {
+        ++frame;
+        while(releasedFrames_.load() + 2 < frame) {
+            snapshotReleased_.waitOnSignal(100);
+            if(!simRunning_.load()) {
+                return;
+            }
+        }
+        simTiming_.tickFrame();
+        inputQueue_->executeEvents();
+        currentScene_->tickAnimations(simTiming_);
+        captureSnapshot(snapshots_[frame & 1]);
+        simFrames_.store(frame);
+        snapshotPublished_.signal();
+    }
+}
+
+// Sets snapshot_ to the scene to render this frame.  Pipelined it releases the last
+// frame's snapshot and takes the next one, false if the simulation has not published
+// it in time.
+bool
+GpuEngineImpl::acquireSnapshot() {
+
+    if(!pipelined_) {
+        captureSnapshot(snapshots_[0]);
+        snapshot_ = &snapshots_[0];
+        return(true);
+    }
+    uint64_t frame = acquiredFrames_ + 1;
+    releasedFrames_.store(frame - 1);
+    snapshotReleased_.signal();
+
+    while(simFrames_.load() < frame) {
+        if(snapshotPublished_.waitOnSignal(100) != 0 && simFrames_.load() < frame) {
+            return(false);
+        }
+    }
+    acquiredFrames_ = frame;
+    snapshot_ = &snapshots_[frame & 1];
+    return(true);
+}
+
+// the shaders and instance array are made for the format, so only before init()
+void
+GpuEngineImpl::setInstanceFormat(GpuEngine::InstanceFormat format) {
+    if(device_) {
+        AD_LOG(error) << "the instance format has to be set before the engine is created";
+        return;
+    }
+    instanceFormat_ = format;
+}
+
+uint32_t
+GpuEngineImpl::instanceStride() const {
+    switch(instanceFormat_) {
+        case GpuEngine::InstanceAffine:
+            return(sizeof(InstanceDataAffine));
+        case GpuEngine::InstanceQuaternion:
+            return(sizeof(InstanceDataQuat));
+        default:
+            return(sizeof(InstanceData));
+    }
+}
+
+uint32_t
+GpuEngineImpl::instanceFeatures() const {
+    switch(instanceFormat_) {
+        case GpuEngine::InstanceAffine:
+            return(ShaderManager::FeatureAffineInstances);
+        case GpuEngine::InstanceQuaternion:
+            return(ShaderManager::FeatureQuatInstances);
+        default:
+            return(0);
+    }
+}
+
+void
+GpuEngineImpl::setPipelined(bool on) {
+    if(on == pipelined_) {
+        return;
+    }
+    stopSimulation();
+    pipelined_ = on;
+    if(on) {
+        simFrames_.store(0);
+        releasedFrames_.store(0);
+        acquiredFrames_ = 0;
+        simTiming_ = timing_;
+        simRunning_.store(true);
+        simThread_ = ObjectPtr<Thread>::make(ObjectPtr<SimulationRunner>::make(*this));
+        simThread_->start();
+    }
+}
+
+void
+GpuEngineImpl::stopSimulation() {
+    if(!simThread_) {
+        return;
+    }
+    simRunning_.store(false);
+    snapshotReleased_.signal();
+    snapshotPublished_.signal();
+    simThread_->join(5000);
+    simThread_ = nullptr;
+}
 //static void doBuf(size_t, Buffer) {
 //
 //}
 
+// dense id of a pointer, in the order first seen this frame
+static uint32_t frameId(std::unordered_map<void*,uint32_t> &ids, void *p) {
+    return(ids.emplace(p, (uint32_t)ids.size()).first->second);
+}
+
+// sets visibleDrawables_ to the snapshot's drawables, culled to the frustum if cpuCulling_
+void
+GpuEngineImpl::cullDrawables(const Matrix4f &vp) {
+
+    std::vector<SceneSnapshot::Drawable> &drawables = snapshot_->drawables;
+    visibleDrawables_.clear();
+
+    if(!cpuCulling_) {
+        for(uint32_t i = 0; i < (uint32_t)drawables.size(); ++i) {
+            visibleDrawables_.push_back(i);
+        }
+        return;
+    }
+    culler_.clear();
+    for(uint32_t i = 0; i < (uint32_t)drawables.size(); ++i) {
+        const SceneSnapshot::Drawable &d = drawables[i];
+        const DrawableMesh *mesh = d.mesh.get();
+        if(mesh->hasBounds()) {
+            culler_.add(d.world, mesh->bounds_, mesh->boxMin_, mesh->boxMax_, i);
+        } else {
+            culler_.add(d.world, mesh->bounds_, i);  // always passes
+        }
+    }
+    culler_.setPlanes(vp);
+    culler_.cull(visibleDrawables_);
+}
+
+wgpu::ShaderModule
+GpuEngineImpl::sceneShaderVariant(uint32_t features) {
+    features |= instanceFeatures();
+    wgpu::ShaderModule &module = sceneShaders_[features & (sceneShaders_.size() - 1)];
+    if(!module) {
+        module = shaderManager_->getVariant("testShader1.wgsl", features);
+    }
+    return(module);
+}
+
+// the ShaderManager::Feature bits of the lights in the snapshot
+void
+GpuEngineImpl::updateLightFeatures() {
+    lightFeatures_ = 0;
+    for(const SceneSnapshot::LightEntry &light : snapshot_->lights) {
+        lightFeatures_ |= ShaderManager::FeatureLit;
+        if(light.data.type_ == LightNode::directional) {
+            lightFeatures_ |= ShaderManager::FeatureDirectional;
+        } else if(light.data.type_ == LightNode::point) {
+            lightFeatures_ |= ShaderManager::FeaturePoint;
+        }
+    }
+}
+
+// What the render queue needs of a material, read with the scene so the render thread
+// never reads a material the simulation may be changing.
+void
+GpuEngineImpl::captureMaterialState(Material *mat, SceneSnapshot::MaterialState &state) {
+    state.features = 0;
+    if(mat->getDiffuseTexture()) {
+        state.features |= ShaderManager::FeatureTextured;
+    }
+    const glm::vec4 &emissive = mat->data_.emissive_;
+    if(emissive.r != 0 || emissive.g != 0 || emissive.b != 0) {
+        state.features |= ShaderManager::FeatureEmissive;
+    }
+    state.cullMode = (WGPUCullMode)mat->getCullMode();
+    state.bindings = mat->getBindings();
+}
+
+// The pipeline a material draws with, the scene shader variant with only what it and
+// the lights use, in its cull mode.  The fallback while that is made.
+wgpu::RenderPipeline
+GpuEngineImpl::pipelineFor(const SceneSnapshot::MaterialState &state) {
+    PipelineKey key = opaqueKey_;
+    key.module = sceneShaderVariant(lightFeatures_ | state.features);
+    key.cullMode = state.cullMode;
+    return(pipelineCache_->get(key));
+}
+
+void
+GpuEngineImpl::buildRenderQueue() {
+
+    std::vector<SceneSnapshot::Drawable> &drawables = snapshot_->drawables;
+    wgpu::BindGroup defaultBindings = snapshot_->defaultMaterial.bindings;
+    const Matrix4f &view = snapshot_->view;
+
+    Matrix4f vp = snapshot_->projection * view;
+    cullDrawables(vp);
+    updateLightFeatures();
+
+    renderQueue_.clear();
+    drawGroups_.clear();
+    pipelineIds_.clear();
+    bindingsIds_.clear();
+    bufferIds_.clear();
+    meshIds_.clear();
+
+    // drawables mostly share a few materials
+    Material *lastMaterial = nullptr;
+    wgpu::RenderPipeline pipeline = pipelineFor(snapshot_->defaultMaterial);
+
+    size_t count = ensureInstanceCapacity((uint32_t)visibleDrawables_.size());
+    for(size_t v = 0; v < count; ++v) {
+        uint32_t i = visibleDrawables_[v];
+        const SceneSnapshot::Drawable &d = drawables[i];
+        DrawableMesh *mesh = d.mesh.get();
+        if(d.material.get() != lastMaterial) {
+            lastMaterial = d.material.get();
+            pipeline = pipelineFor(d.materialState);
+        }
+        wgpu::BindGroup bindings = d.materialState.bindings;
+        if(!bindings) {
+            bindings = defaultBindings;
+        }
+        const BufferChunk &vChunk = mesh->vChunk_;
+        // view space z of the node's origin, the camera looks down -z
+        const glm::vec4 &origin = d.world[3];
+        float viewZ = view[0].z * origin.x + view[1].z * origin.y + view[2].z * origin.z + view[3].z;
+
+        uint64_t key = RenderQueue::makeKey(RenderQueue::PassOpaque,
+                                            frameId(pipelineIds_, (void*)pipeline),
+                                            frameId(bindingsIds_, (void*)bindings),
+                                            frameId(bufferIds_, (void*)vChunk.getBuffer()),
+                                            frameId(meshIds_, mesh),
+                                            -viewZ);
+        renderQueue_.push(key, i);
+    }
+
+    renderQueue_.sort();
+
+    // a new group where the state changes, the ids saturate if there are too many of
+    // them so the pointers are checked as well.
+    uint64_t lastState = 0;
+    lastMaterial = nullptr;
+    pipeline = pipelineFor(snapshot_->defaultMaterial);
+    for(uint32_t i = 0; i < (uint32_t)renderQueue_.size(); ++i) {
+        const RenderQueue::Entry &entry = renderQueue_[i];
+        const SceneSnapshot::Drawable &d = drawables[entry.item];
+        DrawableMesh *mesh = d.mesh.get();
+        wgpu::BindGroup bindings = d.materialState.bindings;
+        if(!bindings) {
+            bindings = defaultBindings;
+        }
+        if(d.material.get() != lastMaterial) {
+            lastMaterial = d.material.get();
+            pipeline = pipelineFor(d.materialState);
+        }
+        uint64_t state = entry.key & RenderQueue::StateMask;
+        if(drawGroups_.empty() || state != lastState || drawGroups_.back().mesh != mesh
+           || (void*)(drawGroups_.back().bindings) != (void*)bindings
+           || (void*)(drawGroups_.back().pipeline) != (void*)pipeline) {
+            drawGroups_.push_back({ pipeline, bindings, mesh, i, 0 });
+            lastState = state;
+        }
+        ++drawGroups_.back().instanceCount;
+    }
+}
+
+// Grows a per frame array's chunk to hold count elements.  The scene bind group is
+// rebuilt which also has everything uploaded again.  Returns the count it holds.
+uint32_t
+GpuEngineImpl::ensureCapacity(ObjectPtr<BufferChunk> &chunk, uint32_t count, uint32_t elementSize) {
+
+    uint32_t capacity = (uint32_t)(chunk->getSize() / elementSize);
+    if(count <= capacity) {
+        return(count);
+    }
+    if(!bufferManager_->growChunk(chunk, (uint64_t)count * elementSize)) {
+        AD_LOG(error) << "can not grow array of " << capacity << " to " << count;
+        return(capacity);
+    }
+    createSceneBindGroup();
+    return(count);
+}
+
+// the instance array and those indexed by instance or draw group
+uint32_t
+GpuEngineImpl::ensureInstanceCapacity(uint32_t count) {
+
+    count = ensureCapacity(instanceBuffer_, count, instanceStride());
+    count = ensureCapacity(visibleBuffer_, count, sizeof(uint32_t));
+    count = ensureCapacity(indirectBuffer_, count, sizeof(DrawIndexedIndirectArgs));
+    return(cullingPass_->ensureCapacity(count));
+}
+
+// Slots of the material array holding a different material or one with changed data
+// are uploaded.
+void
+GpuEngineImpl::uploadMaterials() {
+
+    std::vector<SceneSnapshot::MaterialEntry> &materials = snapshot_->materials;
+    uint32_t count = ensureCapacity(materialBuffer_, (uint32_t)materials.size(), sizeof(MaterialShaderData));
+
+    materialSlots_.resize(count, { nullptr, 0 });
+    dirtyRanges_.clear();
+
+    for(uint32_t i = 0; i < count; ++i) {
+        const SceneSnapshot::MaterialEntry &mat = materials[i];
+        MaterialSlot &slot = materialSlots_[i];
+        if(uploadAll_ || slot.material != mat.material || slot.dataStamp != mat.dataStamp) {
+            slot = { mat.material, mat.dataStamp };
+            dirtyRanges_.mark(i);
+        }
+    }
+
+    for(const DirtyRanges::Range &range : dirtyRanges_.ranges()) {
+        auto *mData = (MaterialShaderData *)bufferManager_->stageFrameUpload(materialBuffer_,
+                                    range.begin * sizeof(MaterialShaderData), range.count() * sizeof(MaterialShaderData));
+        if(!mData) {
+            uploadAll_ = true;  // could not be staged this frame, all of it goes again next frame
+            return;
+        }
+        for(uint32_t i = range.begin; i < range.end; ++i) {
+            *mData++ = materials[i].data;
+        }
+    }
+}
+
+// stages the dirty ranges of the instance array encoded as T, false if it couldn't
+template<class T>
+bool
+GpuEngineImpl::writeInstances() {
+
+    std::vector<SceneSnapshot::Drawable> &drawables = snapshot_->drawables;
+
+    for(const DirtyRanges::Range &range : dirtyRanges_.ranges()) {
+        auto *iData = (T *)bufferManager_->stageFrameUpload(instanceBuffer_,
+                                    range.begin * sizeof(T), range.count() * sizeof(T));
+        if(!iData) {
+            return(false);
+        }
+        for(uint32_t i = range.begin; i < range.end; ++i, ++iData) {
+            const SceneSnapshot::Drawable &d = drawables[renderQueue_[i].item];
+            InstanceWriter<T>::write(*iData, d.world, (uint32_t)d.materialIx, d.index);
+        }
+    }
+    return(true);
+}
+
+// A slot of the instance array is uploaded when a different drawable lands in it, or
+// the one there has moved or changed material.  Needs the render queue built.
+void
+GpuEngineImpl::uploadInstances() {
+
+    std::vector<SceneSnapshot::Drawable> &drawables = snapshot_->drawables;
+    uint32_t count = (uint32_t)renderQueue_.size();
+
+    instanceSlots_.resize(count, { nullptr, 0, 0, 0 });
+    dirtyRanges_.clear();
+
+    for(uint32_t i = 0; i < count; ++i) {
+        const SceneSnapshot::Drawable &d = drawables[renderQueue_[i].item];
+
+        InstanceSlot &slot = instanceSlots_[i];
+        if(uploadAll_ || slot.node != d.node || slot.drawable != d.index
+           || slot.worldStamp != d.worldStamp || slot.materialIx != d.materialIx) {
+            slot = { d.node, d.index, d.worldStamp, d.materialIx };
+            dirtyRanges_.mark(i);
+        }
+    }
+
+    bool ok;
+    switch(instanceFormat_) {
+        case GpuEngine::InstanceAffine:
+            ok = writeInstances<InstanceDataAffine>();
+            break;
+        case GpuEngine::InstanceQuaternion:
+            ok = writeInstances<InstanceDataQuat>();
+            break;
+        default:
+            ok = writeInstances<InstanceData>();
+            break;
+    }
+    if(!ok) {
+        uploadAll_ = true;
+    }
+}
+
+// Lights that moved or changed are uploaded, sets uniforms.numLights.  Returns true
+// if any did or the count changed.
+bool
+GpuEngineImpl::uploadLights() {
+
+    std::vector<SceneSnapshot::LightEntry> &lights = snapshot_->lights;
+    uint32_t count = ensureCapacity(lightBuffer_, (uint32_t)lights.size(), sizeof(LightShaderData));
+    uniforms.numLights = count;
+
+    bool changed = count != lightSlots_.size();
+    lightSlots_.resize(count, { nullptr, 0, 0 });
+    dirtyRanges_.clear();
+
+    for(uint32_t i = 0; i < count; ++i) {
+        const SceneSnapshot::LightEntry &light = lights[i];
+        LightSlot &slot = lightSlots_[i];
+        if(uploadAll_ || slot.light != light.light || slot.worldStamp != light.worldStamp
+           || slot.dataStamp != light.dataStamp) {
+            slot = { light.light, light.worldStamp, light.dataStamp };
+            dirtyRanges_.mark(i);
+        }
+    }
+
+    for(const DirtyRanges::Range &range : dirtyRanges_.ranges()) {
+        auto *lData = (LightShaderData *)bufferManager_->stageFrameUpload(lightBuffer_,
+                                    range.begin * sizeof(LightShaderData), range.count() * sizeof(LightShaderData));
+        if(!lData) {
+            uploadAll_ = true;
+            return(true);
+        }
+        for(uint32_t i = range.begin; i < range.end; ++i) {
+            *lData++ = lights[i].data;
+        }
+    }
+    return(changed || !dirtyRanges_.empty());
+}
+
+// The lights are binned again when they or the camera changed, sets the uniforms'
+// cluster fields.
+void
+GpuEngineImpl::uploadLightClusters(bool lightsChanged) {
+
+    const SceneSnapshot &snap = *snapshot_;
+    uniforms.clusterScale = glm::vec4((float)LightClusters::TilesX / (float)std::max(width_, 1),
+                                      (float)LightClusters::TilesY / (float)std::max(height_, 1),
+                                      lightClusters_.sliceScale(), lightClusters_.sliceBias());
+    uniforms.numGlobalLights = lightClusters_.globalCount();
+
+    if(!(uploadAll_ || lightsChanged || snap.view != clusterView_ || snap.projection != clusterProjection_)) {
+        return;
+    }
+    clusterView_ = snap.view;
+    clusterProjection_ = snap.projection;
+
+    lightClusters_.build(snap.view, snap.projection, snap.nearClip, snap.farClip, snap.lights, uniforms.numLights);
+    uint32_t needed = (uint32_t)lightClusters_.indices().size();
+    if(ensureCapacity(lightIndexBuffer_, needed, sizeof(uint32_t)) < needed) {
+        lightClusters_.dropLocal();
+    }
+    uniforms.clusterScale.z = lightClusters_.sliceScale();
+    uniforms.clusterScale.w = lightClusters_.sliceBias();
+    uniforms.numGlobalLights = lightClusters_.globalCount();
+
+    const std::vector<LightCluster> &clusters = lightClusters_.clusters();
+    const std::vector<uint32_t> &indices = lightClusters_.indices();
+    auto *cData = (LightCluster *)bufferManager_->stageFrameUpload(clusterBuffer_, 0,
+                                    (uint32_t)(clusters.size() * sizeof(LightCluster)));
+    auto *iData = indices.empty() ? nullptr
+                : (uint32_t *)bufferManager_->stageFrameUpload(lightIndexBuffer_, 0,
+                                    (uint32_t)(indices.size() * sizeof(uint32_t)));
+    if(!cData || (!iData && !indices.empty())) {
+        uploadAll_ = true;
+        return;
+    }
+    std::memcpy(cData, clusters.data(), clusters.size() * sizeof(LightCluster));
+    if(iData) {
+        std::memcpy(iData, indices.data(), indices.size() * sizeof(uint32_t));
+    }
+}
+
+// Encodes the opaque draw groups [begin, end) into a render pass or a render bundle
+// encoder, they have the same calls.  Returns false if a mesh was skipped because its
+// upload is not done.
+template<class EncoderT>
+bool
+GpuEngineImpl::encodeDraws(EncoderT &renderPass, size_t begin, size_t end) {
+
+    bool complete = true;
+    wgpu::RenderPipeline lastPipeline = nullptr;
+
+    { // draw the models ( needs to be organized )}
+
+        wgpu::BindGroup lastMaterialBindings = getDefaultMaterial()->getBindings();
+
+//        if(timing().isDebugFrame()) {
+//            AD_LOG(info)  << "DEBUG FRAME " <<  timing().frameNumber();
+//        }
+                
+        // set group for scene specific data being used.
+        renderPass.setBindGroup(0, bindGroup, 0, nullptr);
+        renderPass.setBindGroup(1, lastMaterialBindings, 0, nullptr); // default texture
+
+        // Meshes mostly share the same geometry buffers so whole buffers are bound and the
+        // draws index into them, they are only re-bound when a mesh is in another buffer.
+        Buffer boundVertices = nullptr;
+        Buffer boundIndices = nullptr;
+
+        // one instanced draw per group of drawables sharing bindings and mesh
+        for(size_t groupIx = begin; groupIx < end; ++groupIx) {
+            const DrawGroup &group = drawGroups_[groupIx];
+
+            if((void*)group.pipeline != (void*)lastPipeline) {
+                lastPipeline = group.pipeline;
+                renderPass.setPipeline(lastPipeline);
+            }
+            if((void*)group.bindings != (void*)lastMaterialBindings) {
+                lastMaterialBindings = group.bindings;
+                renderPass.setBindGroup(1, group.bindings, 0, nullptr);
+            }
+            DrawableMesh *mesh = group.mesh;
+
+            // skip until the batch it was uploaded in is done
+            if(!bufferManager_->isUploadComplete(mesh->uploadFence_)) {
+                complete = false;
+                continue;
+            }
+            const BufferChunk &iChunk = mesh->iChunk_;
+            const BufferChunk &vChunk = mesh->vChunk_;
+
+            if((void*)vChunk.getBuffer() != (void*)boundVertices) {
+                boundVertices = vChunk.getBuffer();
+                renderPass.setVertexBuffer(0, boundVertices, 0, WGPU_WHOLE_SIZE);
+            }
+            if((void*)iChunk.getBuffer() != (void*)boundIndices) {
+                boundIndices = iChunk.getBuffer();
+                renderPass.setIndexBuffer(boundIndices, IndexFormat::Uint16, 0, WGPU_WHOLE_SIZE);
+            }
+            if(indirectDraws_) {
+                renderPass.drawIndexedIndirect(indirectBuffer_->getBuffer(),
+                                indirectBuffer_->getStartOffset() + groupIx * sizeof(DrawIndexedIndirectArgs));
+                continue;
+            }
+            // vertex chunks are aligned to the vertex size so the offset is a whole vertex
+            uint32_t firstIndex = (uint32_t)(iChunk.getStartOffset() / sizeof(uint16_t));
+            int32_t baseVertex = (int32_t)(vChunk.getStartOffset() / sizeof(GpuVertexAttributes));
+
+            renderPass.drawIndexed(mesh->indexCount(), group.instanceCount, firstIndex, baseVertex, group.firstInstance);
+        }
+    }
+    return(complete);
+}
+
+// The recorded draws still apply if the groups draw the same meshes with the same
+// pipelines and bindings from the same places.  Indirect draws read their instance ranges from the
+// arguments so only the direct ones need those the same.
+bool
+GpuEngineImpl::opaqueBundleValid() {
+
+    if(opaqueBundles_.empty() || drawListDirty_ || bundleIndirect_ != indirectDraws_
+       || bundleRelocations_ != bufferManager_->getRelocationCount()
+       || bundleGroups_.size() != drawGroups_.size()) {
+        return(false);
+    }
+    for(size_t i = 0; i < drawGroups_.size(); ++i) {
+        const DrawGroup &a = drawGroups_[i];
+        const DrawGroup &b = bundleGroups_[i];
+        if(a.mesh != b.mesh || (void*)a.bindings != (void*)b.bindings || (void*)a.pipeline != (void*)b.pipeline) {
+            return(false);
+        }
+        if(!indirectDraws_ && (a.firstInstance != b.firstInstance || a.instanceCount != b.instanceCount)) {
+            return(false);
+        }
+    }
+    return(true);
+}
+
+void
+GpuEngineImpl::releaseOpaqueBundles() {
+    for(RenderBundle &bundle : opaqueBundles_) {
+        bundle.release();
+    }
+    opaqueBundles_.clear();
+}
+
+void
+GpuEngineImpl::setIndirectDraws(bool on) {
+    if(on && !indirectFirstInstance_) {
+        AD_LOG(error) << "indirect draws need indirect-first-instance, drawing directly";
+        return;
+    }
+    indirectDraws_ = on;
+}
+
+void
+GpuEngineImpl::setGpuCulling(bool on) {
+    if(on && !indirectFirstInstance_) {
+        AD_LOG(error) << "GPU culling needs indirect-first-instance, not culling";
+        return;
+    }
+    gpuCulling_ = on;
+    if(on) {
+        indirectDraws_ = true;
+    }
+}
+
+void
+GpuEngineImpl::setEncodeThreads(int count) {
+    count = std::max(count, 1);
+    if(count > 1 && !threadSafeDevice_) {
+        AD_LOG(error) << "the device can not be used from several threads, recording on one";
+        count = 1;
+    }
+    if(count == encodeThreads_) {
+        return;
+    }
+    encodeThreads_ = count;
+    // the render thread records a range too
+    encodeWorkers_ = count > 1 ? std::make_unique<WorkerPool>(count - 1) : nullptr;
+    invalidateDrawList();
+}
+
+// The encoders are made and finished on the render thread, the recording in between
+// is done on the workers, each encoder only ever used by one thread.  With Dawn the
+// device needs to have been made with implicit device synchronization for this.
+void
+GpuEngineImpl::recordOpaqueBundles() {
+
+    static const size_t minGroupsPerBundle = 256;
+
+    releaseOpaqueBundles();
+
+    size_t groupCount = drawGroups_.size();
+    size_t bundleCount = 1;
+    if(encodeWorkers_) {
+        bundleCount = std::max<size_t>(1, std::min<size_t>(encodeThreads_, groupCount / minGroupsPerBundle));
+    }
+
+    RenderBundleEncoderDescriptor bundleEncoderDesc{};
+    bundleEncoderDesc.label = "Opaque draws";
+    bundleEncoderDesc.colorFormatsCount = 1;
+    bundleEncoderDesc.colorFormats = (WGPUTextureFormat*)&swapChainFormat_;
+    bundleEncoderDesc.depthStencilFormat = depthTextureFormat_;
+    bundleEncoderDesc.sampleCount = 1;
+    bundleEncoderDesc.depthReadOnly = false;
+    bundleEncoderDesc.stencilReadOnly = true;
+    std::vector<RenderBundleEncoder> encoders;
+    for(size_t i = 0; i < bundleCount; ++i) {
+        encoders.push_back(device_.createRenderBundleEncoder(bundleEncoderDesc));
+    }
+
+    // contiguous ranges of the sorted groups so executing the bundles in order keeps it
+    std::vector<char> complete(bundleCount, 0);
+    auto record = [&](int ix) {
+        size_t begin = groupCount * ix / bundleCount;
+        size_t end = groupCount * (ix + 1) / bundleCount;
+        complete[ix] = encodeDraws(encoders[ix], begin, end);
+    };
+    if(bundleCount > 1) {
+        encodeWorkers_->run((int)bundleCount, record);
+    } else {
+        record(0);
+    }
+
+    bool allComplete = true;
+    RenderBundleDescriptor bundleDesc{};
+    bundleDesc.label = "Opaque draws";
+    for(size_t i = 0; i < bundleCount; ++i) {
+        opaqueBundles_.push_back(encoders[i].finish(bundleDesc));
+        encoders[i].release();
+        allComplete = allComplete && complete[i];
+    }
+
+    // meshes still uploading are missing, record again next frame
+    drawListDirty_ = !allComplete;
+    bundleIndirect_ = indirectDraws_;
+    bundleRelocations_ = bufferManager_->getRelocationCount();
+    bundleGroups_ = drawGroups_;
+}
+
 int
 GpuEngineImpl::renderFrame()  {
 
@@ -839,122 +1691,77 @@ GpuEngineImpl::renderFrame()  {
     if(!instance) {
         return(-1);
     }
+    if(!acquireSnapshot()) {
+        return(0);
+    }
+    // meshes or materials were added, removed or swapped since the last frame rendered
+    if(snapshot_->drawListVersion != lastDrawListVersion_) {
+        lastDrawListVersion_ = snapshot_->drawListVersion;
+        invalidateDrawList();
+    }
     
   //  Queue queue = device.getQueue();
 
     {
-        static const int bufferSize = 0x2000;
-        std::unique_ptr<uint8_t> workBuffer(new uint8_t[bufferSize]); // todo pick optimum buffer size ?
-
         // update data on GPU for active (visible) object instances.
+        // It is all packed into this frame's staging slot and copied to the GPU
+        // in the frame's command buffer.
  
-        // upload active material data array
-        {
-            
-            Buffer iBuffer = materialBuffer_->getBuffer();
-            auto offset = materialBuffer_->getStartOffset();
-
-            int uploadCount = 0;   // TODO: for now we just assume the buffer is allocated big enough !!!
-            int materialIndex = 0;
-
-            const int maxCount = (int)(bufferSize/sizeof(MaterialShaderData));
-            MaterialShaderData *iData = (MaterialShaderData *)workBuffer.get();
-
-            for(auto it = currentScene_->activeMaterials_->begin(); it != currentScene_->activeMaterials_->end(); ++it) {
-                Material &mat = *it;
-
-                if(uploadCount < maxCount) {
-                    mat.loadShaderData(iData[uploadCount]);
-                    mat.setIndex(materialIndex);
-                    ++materialIndex;
-                    ++uploadCount;
-                } else {
-                    queue.writeBuffer(iBuffer, offset, &iData[0], uploadCount * sizeof(*iData) );
-                    uploadCount = 0;
-                }
-            }
-            if(uploadCount > 0) {
-                 queue.writeBuffer(iBuffer, offset, &iData[0], uploadCount * sizeof(*iData) );
-            }
+        // upload active material data array, then the instance data which has the
+        // material indices.  It is in render queue order, the objectId is the index in
+        // the scene's drawables.
+        uploadMaterials();
+        buildRenderQueue();
+        uploadInstances();
+
+        // with culling the compute pass counts the visible instances into the arguments.
+        uint32_t cullCount = 0;
+        if(gpuCulling_ && indirectDraws_) {
+            cullCount = cullingPass_->stageInputs();
         }
 
-        // upload instance data array, done after material indices are assigned and data uploaded
-        {
-            Buffer iBuffer = instanceBuffer_->getBuffer();
-            auto offset = instanceBuffer_->getStartOffset();
- //           doBuf(offset,iBuffer);
-
-            int countLeft = (int)currentScene_->drawables_.size();
-            // temp buffer to upload
-            const int maxCount = (int)(bufferSize/sizeof(InstanceData));
-            int uploadCount = (int)std::min(maxCount,countLeft);
-            InstanceData *iData = (InstanceData *)workBuffer.get();
-
-            while(countLeft > 0) {
-                int i = 0;
-                
-                for(; i < uploadCount; ++i) {
-                    currentScene_->drawables_[i]->loadInstanceData(iData[i]);
+        // upload the draw arguments, one per group.
+        if(indirectDraws_ && !drawGroups_.empty()) {
+            auto *args = (DrawIndexedIndirectArgs *)bufferManager_->stageFrameUpload(indirectBuffer_, 0,
+                                                        (uint32_t)(drawGroups_.size() * sizeof(DrawIndexedIndirectArgs)));
+            if(args) {
+                for(size_t i = 0; i < drawGroups_.size(); ++i) {
+                    const DrawGroup &group = drawGroups_[i];
+                    const DrawableMesh *mesh = group.mesh;
+                    const BufferChunk &iChunk = mesh->iChunk_;
+                    const BufferChunk &vChunk = mesh->vChunk_;
+                    args[i].indexCount = (uint32_t)mesh->indexCount();
+                    args[i].instanceCount = cullCount ? 0 : group.instanceCount;
+                    args[i].firstIndex = (uint32_t)(iChunk.getStartOffset() / sizeof(uint16_t));
+                    args[i].baseVertex = (int32_t)(vChunk.getStartOffset() / sizeof(GpuVertexAttributes));
+                    args[i].firstInstance = group.firstInstance;
                 }
-                countLeft -= i;
-                // upload a buffer full
-                i *= sizeof(*iData);
-                queue.writeBuffer(iBuffer, offset, &iData[0], i );
-                offset += i;
-                uploadCount = (int)std::min(maxCount,countLeft);
+            } else {
+                indirectDraws_ = false;
+                cullCount = 0;
+                AD_LOG(error) << "could not stage indirect draw arguments, drawing directly";
             }
         }
         
-        // upload uniforms data "scene globals" PLUS array of lights
+        // upload the lights and their clusters then the uniforms data "scene globals"
+        // which has their counts
+        bool lightsChanged = uploadLights();
+        uploadLightClusters(lightsChanged);
         {
-            const int headerSize = sizeof(SceneUniforms);
-            
             // update the global uniform data - camera transforms, lights etc
-            auto camera = currentScene_->currentCamera_->getCamera();
-            uniforms.viewMatrix = camera->getView();
-            uniforms.projectionMatrix = camera->getProjection();
-            uniforms.eyePose = camera->getPose(); // glm::inverse(camera->getView());
+            uniforms.viewMatrix = snapshot_->view;
+            uniforms.projectionMatrix = snapshot_->projection;
+            uniforms.eyePose = snapshot_->eyePose; // glm::inverse(camera->getView());
             uniforms.vpMatrix = uniforms.projectionMatrix * uniforms.viewMatrix;
             uniforms.passType = SceneUniforms::PassTypeOpaque;
+            uniforms.cullCount = cullCount;
 
-            uniforms.numLights = (uint32_t)currentScene_->lights_.size();
-
-            const int initialMax = (int)((bufferSize-headerSize)/sizeof(LightShaderData));
-            int countLeft = uniforms.numLights;
-            int uploadCount = (int)std::min(initialMax,countLeft);
-            
-
-            const int maxCount = (int)(bufferSize/sizeof(LightShaderData));
- 
-            Buffer iBuffer = uniformBuffer_->getBuffer();
-            auto offset = uniformBuffer_->getStartOffset();
-    //        doBuf(offset,iBuffer);
-
-            uint8_t *outBytes = workBuffer.get();
-            (*(SceneUniforms *)outBytes) = uniforms;
-            outBytes += headerSize;
-            
-            int lightIx = 0;
-                
-            for(;;) {
-                for(int i = 0; i < uploadCount; ++i) {
-                    currentScene_->lights_[lightIx]->loadShaderData(*(LightShaderData*)outBytes);
-                    ++lightIx;
-                    outBytes += sizeof(LightShaderData);
-                }
-                if(outBytes > workBuffer.get()) {
-                    int writeSize = (int)(outBytes - workBuffer.get());
-                    outBytes = workBuffer.get();
-                    queue.writeBuffer(iBuffer, offset, outBytes, writeSize );
-                    countLeft -= uploadCount;
-                    if(countLeft <= 0) {
-                        break;
-                    }
-                    offset += writeSize;
-                    uploadCount = (int)std::min(maxCount,countLeft);
-                }
+            auto *outUniforms = (SceneUniforms *)bufferManager_->stageFrameUpload(uniformBuffer_, 0, sizeof(SceneUniforms));
+            if(outUniforms) {
+                *outUniforms = uniforms;
             }
         }
+        uploadAll_ = false;
 
     }
     
@@ -963,7 +1770,20 @@ GpuEngineImpl::renderFrame()  {
         device_.tick();
 #endif
    
-
+    // chunks in the scene bind group may have been moved by buffer compaction
+    if(bufferManager_->getRelocationCount() != lastRelocationCount_) {
+        lastRelocationCount_ = bufferManager_->getRelocationCount();
+        uint32_t stamp = uniformBuffer_->getRelocationCount()
+                       + instanceBuffer_->getRelocationCount()
+                       + materialBuffer_->getRelocationCount()
+                       + visibleBuffer_->getRelocationCount()
+                       + lightBuffer_->getRelocationCount()
+                       + clusterBuffer_->getRelocationCount()
+                       + lightIndexBuffer_->getRelocationCount();
+        if(stamp != sceneBindingsStamp_) {
+            createSceneBindGroup();
+        }
+    }
     
     wgpu::TextureView nextTexture = getNextTexture();
     if (!nextTexture) {
@@ -975,6 +1795,10 @@ GpuEngineImpl::renderFrame()  {
     commandEncoderDesc.label = "Command Encoder";
     CommandEncoder encoder = device_.createCommandEncoder(commandEncoderDesc);
 
+    // copy this frame's staged data into place before the pass.
+    bufferManager_->flushFrameUploads(encoder);
+    cullingPass_->encode(encoder, uniforms.cullCount);
+
     RenderPassDescriptor renderPassDesc{};
 
     renderPassDesc.label = "OneFramePass";
@@ -985,7 +1809,7 @@ GpuEngineImpl::renderFrame()  {
     renderPassColorAttachment.loadOp = LoadOp::Clear;
     renderPassColorAttachment.storeOp = StoreOp::Store;
     {
-        auto &c = currentScene_->backgroundColor_;
+        auto &c = snapshot_->background;
         renderPassColorAttachment.clearValue = Color(c.r,c.g,c.b,c.a);
     }
     renderPassDesc.colorAttachmentCount = 1;
@@ -1012,45 +1836,14 @@ GpuEngineImpl::renderFrame()  {
     renderPassDesc.timestampWrites = nullptr;
 
     RenderPassEncoder renderPass = encoder.beginRenderPass(renderPassDesc);
-    // Select which render pipeline to use
-    renderPass.setPipeline(pipeline);
 
-    { // draw the models ( needs to be organized )}
-
-        wgpu::BindGroup lastMaterialBindings = getDefaultMaterial()->getBindings();
-
-//        if(timing().isDebugFrame()) {
-//            AD_LOG(info)  << "DEBUG FRAME " <<  timing().frameNumber();
-//        }
-                
-        // set group for scene specific data being used.
-        renderPass.setBindGroup(0, bindGroup, 0, nullptr);
-        renderPass.setBindGroup(1, lastMaterialBindings, 0, nullptr); // default texture
-        for(size_t i = 0; i < currentScene_->drawables_.size(); ++i) {
-
-            auto drawable = currentScene_->drawables_[i];
-            Material *matl = drawable->getMaterial().get();
-            auto bindings = matl->getBindings();
-                        
-            if(bindings && ( (void*)bindings) != ((void*)lastMaterialBindings) ) {
-//                if(bindings && (bindings != lastMatlBindings) ) {
-//                if(bindings && ( ((WGPUBindGroupImpl *)bindings) != (WGPUBindGroupImpl *)lastMatlBindings) ) {
-                lastMaterialBindings = bindings;
-                renderPass.setBindGroup(1, bindings, 0, nullptr);
-            }
-            DrawableMesh *mesh = drawable->getMesh();
-
-            
-            if(mesh) {
-                const BufferChunk &iChunk = mesh->iChunk_;
-                const BufferChunk &vChunk = mesh->vChunk_;
-
-                renderPass.setVertexBuffer(0, vChunk.getBuffer(), vChunk.getStartOffset(), vChunk.getSize());
-                renderPass.setIndexBuffer(iChunk.getBuffer(), IndexFormat::Uint16, iChunk.getStartOffset(), iChunk.getSize());
-                
-                renderPass.drawIndexed(mesh->indexCount(), 1, 0, 0, (uint32_t)i);
-            }
-        }
+    if(!opaqueBundleValid()) {
+        recordOpaqueBundles();
+    }
+    if(!opaqueBundles_.empty() && opaqueBundles_[0]) {
+        renderPass.executeBundles((uint32_t)opaqueBundles_.size(), (WGPURenderBundle*)opaqueBundles_.data());
+    } else {
+        encodeDraws(renderPass, 0, drawGroups_.size());
     }
     
     renderPass.end();
@@ -1059,6 +1852,7 @@ GpuEngineImpl::renderFrame()  {
     cmdBufferDescriptor.label = "Command buffer";
     CommandBuffer command = encoder.finish(cmdBufferDescriptor);
     queue.submit(command);
+    bufferManager_->onFrameSubmitted();
     presentImage(nextTexture);
 
 
@@ -1116,6 +1910,19 @@ extern "C" {
         return(Engine::getInstance().unlockPixels());
     }
 
+    int getGpuBufferCount() {
+        artd::GpuBufferManager *bm = Engine::getInstance().bufferManager();
+        return(bm ? bm->getStatsBufferCount() : 0);
+    }
+
+    int getGpuBufferStats(int index, GpuBufferStats *pStats) {
+        artd::GpuBufferManager *bm = Engine::getInstance().bufferManager();
+        if(!bm || !pStats || !bm->getBufferStats(index, *pStats)) {
+            return(-1);
+        }
+        return(0);
+    }
+
     void shutdownGPUTest()  {
         AD_LOG(info) << "shutting down WebGPU engine";
         Engine::getInstance().releaseResources();
@@ -23,9 +23,19 @@
 
 #include "./InputManager.h"
 #include "./FpsMonitor.h"
-
+#include "./RenderQueue.h"
+#include "./FrustumCuller.h"
+#include "./DirtyRanges.h"
+#include "./WorkerPool.h"
+#include "./PipelineCache.h"
+#include "./SceneSnapshot.h"
+#include "./LightClusters.h"
+
+#include <glm/gtc/quaternion.hpp>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <unordered_map>
 
 
 #include "PixelReader.h"
@@ -34,6 +44,7 @@ ARTD_BEGIN
 
 class MeshNode;
 class PickerPass;
+class CullingPass;
 class TextureManager;
 class TextureManagerImpl;
 class Material;
@@ -51,9 +62,12 @@ struct SceneUniforms {
 
     uint32_t passType;
     uint32_t numLights;
-    float _pad[1];
+    uint32_t cullCount;  // instances culled on the GPU this frame, 0 if not culling
 
-    static const int MaxLights = 64;
+    // cluster of a fragment, tiles per pixel in x and y, the depth slice scale and bias
+    glm::vec4 clusterScale;
+    uint32_t numGlobalLights;  // at the front of the light index list
+    uint32_t _pad[3];
 
     static const uint32_t PassTypeOpaque = 0;
     static const uint32_t PassTypeTransparency = 1;
@@ -64,6 +78,9 @@ struct SceneUniforms {
 // Have the compiler check byte alignment
 static_assert(sizeof(SceneUniforms) % 16 == 0);
 
+// The encodings of an instance in the instance array, GpuEngine::InstanceFormat picks
+// one for all of them.  They are the InstanceData structs of shaders/instanceFormats.wgsl.
+
 struct InstanceData  {
     glm::mat4x4 modelMatrix;  // model specific
     uint32_t materialId;
@@ -71,7 +88,86 @@ struct InstanceData  {
     uint32_t _pad[2];
 };
 
-static_assert(sizeof(InstanceData) % 16 == 0);
+// the top three rows of the model matrix
+struct InstanceDataAffine {
+    glm::vec4 rows[3];
+    uint32_t materialId;
+    uint32_t objectId;
+    uint32_t _pad[2];
+};
+
+// for transforms with only rotation, translation and uniform scale
+struct InstanceDataQuat {
+    glm::vec4 rotation;  // x y z w
+    glm::vec3 translation;
+    float scale;
+    uint32_t materialId;
+    uint32_t objectId;
+    uint32_t _pad[2];
+};
+
+static_assert(sizeof(InstanceData) == 80);
+static_assert(sizeof(InstanceDataAffine) == 64);
+static_assert(sizeof(InstanceDataQuat) == 48);
+
+// Packs an instance into one of the encodings.
+template<class T>
+class InstanceWriter;
+
+template<>
+class InstanceWriter<InstanceData> {
+public:
+    static INL void write(InstanceData &out, const glm::mat4x4 &world, uint32_t materialId, uint32_t objectId) {
+        out.modelMatrix = world;
+        out.materialId = materialId;
+        out.objectId = objectId;
+    }
+};
+
+template<>
+class InstanceWriter<InstanceDataAffine> {
+public:
+    static INL void write(InstanceDataAffine &out, const glm::mat4x4 &world, uint32_t materialId, uint32_t objectId) {
+        for(int i = 0; i < 3; ++i) {
+            out.rows[i] = glm::vec4(world[0][i], world[1][i], world[2][i], world[3][i]);
+        }
+        out.materialId = materialId;
+        out.objectId = objectId;
+    }
+};
+
+template<>
+class InstanceWriter<InstanceDataQuat> {
+public:
+    // the scale is the first axis', any shear or scale differing by axis is lost
+    static INL void write(InstanceDataQuat &out, const glm::mat4x4 &world, uint32_t materialId, uint32_t objectId) {
+        glm::mat3 basis(world);
+        float scale = glm::length(basis[0]);
+        for(int i = 0; i < 3; ++i) {
+            float length = glm::length(basis[i]);
+            if(length > 0.0f) {
+                basis[i] /= length;
+            }
+        }
+        glm::quat q = glm::quat_cast(basis);
+        out.rotation = glm::vec4(q.x, q.y, q.z, q.w);
+        out.translation = glm::vec3(world[3]);
+        out.scale = scale;
+        out.materialId = materialId;
+        out.objectId = objectId;
+    }
+};
+
+// layout drawIndexedIndirect() reads its arguments in.
+struct DrawIndexedIndirectArgs {
+    uint32_t indexCount;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t baseVertex;
+    uint32_t firstInstance;
+};
+
+static_assert(sizeof(DrawIndexedIndirectArgs) == 20);
 
 using namespace wgpu;
 
@@ -91,6 +187,9 @@ protected:
 
     bool headless_ = true;
     GLFWwindow* window = nullptr;
+    // compiled shaders and pipelines are kept here across runs, empty for none
+    std::filesystem::path cacheDirectory_;
+    GpuEngine::InstanceFormat instanceFormat_ = GpuEngine::InstanceMatrix;
 
     int initGlfwDisplay();
 
@@ -102,19 +201,46 @@ protected:
     wgpu::Adapter adapter = nullptr;
     wgpu::Device device_ = nullptr;
 
+    // limits the device was created with and the sizes derived from them
+    class DeviceProfile {
+    public:
+        LimitsProfile profile = LimitsBalanced;
+        wgpu::Limits limits;
+        uint32_t bufferPoolSize = 0x7FFFFF;        // pooled buffers for chunks
+        uint64_t dedicatedBufferThreshold = 0x200000;  // chunks larger get their own buffer
+        uint32_t geometryBufferSize = 0x1000000;  // shared mesh vertex and index buffers
+        // initial sizes of the per frame arrays, they grow as needed
+        uint32_t instanceCapacity = 128;   // instance data array
+        uint32_t materialCapacity = 64;    // material data array
+        uint32_t lightCapacity = 16;       // light data array
+    };
+    DeviceProfile deviceProfile_;
+
+    void chooseDeviceLimits(const wgpu::Limits &supported, LimitsProfile profile);
+
     std::unique_ptr<wgpu::ErrorCallback> errorCallback_;
     std::unique_ptr<wgpu::DeviceLostCallback> deviceLostCallback_;
     wgpu::Queue queue = nullptr;
     wgpu::Texture targetTexture = nullptr;
     wgpu::TextureView targetTextureView = nullptr;
     wgpu::ShaderModule shaderModule = nullptr;
-    wgpu::RenderPipeline pipeline = nullptr;
+    // testShader1.wgsl variants by ShaderManager::Feature bits, the manager owns them
+    std::array<wgpu::ShaderModule, 256> sceneShaders_;
+    uint32_t lightFeatures_ = 0;
+    ObjectPtr<PipelineCache> pipelineCache_;
+    PipelineKey opaqueKey_;  // the fallback, materials vary it
     wgpu::SwapChain swapChain = nullptr;
    
     wgpu::TextureView depthTextureView = nullptr;
     wgpu::Texture depthTexture = nullptr;
 
     wgpu::BindGroup bindGroup = nullptr;
+    wgpu::BindGroupLayout bindGroupLayout_ = nullptr;
+    wgpu::Sampler sampler0_ = nullptr;
+    uint32_t sceneBindingsStamp_ = 0;  // sum of relocation counts of chunks in bindGroup
+    uint32_t lastRelocationCount_ = 0;
+
+    void createSceneBindGroup();
 
     wgpu::BindGroupLayout materialBindGroupLayout = nullptr;
 
@@ -127,6 +253,8 @@ protected:
     ObjectPtr<LambdaEventQueue> updateQueue_;
     friend class PickerPass;
     ObjectPtr<PickerPass>       pickerPass_;
+    friend class CullingPass;
+    ObjectPtr<CullingPass>      cullingPass_;
 
     // resource management items
     friend class InputManager;
@@ -151,6 +279,12 @@ public:
     INL wgpu::Device device() {
         return(device_);
     }
+    INL const DeviceProfile &deviceProfile() const {
+        return(deviceProfile_);
+    }
+    INL const wgpu::Limits &deviceLimits() const {
+        return(deviceProfile_.limits);
+    }
 
 protected:
 
@@ -159,6 +293,23 @@ protected:
     ObjectPtr<BufferChunk>      uniformBuffer_;
     ObjectPtr<BufferChunk>      instanceBuffer_;
     ObjectPtr<BufferChunk>      materialBuffer_;
+    ObjectPtr<BufferChunk>      lightBuffer_;
+    ObjectPtr<BufferChunk>      indirectBuffer_;  // a DrawIndexedIndirectArgs per draw group
+    ObjectPtr<BufferChunk>      visibleBuffer_;   // instance indices surviving culling
+    ObjectPtr<BufferChunk>      clusterBuffer_;   // a LightCluster per cluster
+    ObjectPtr<BufferChunk>      lightIndexBuffer_;
+
+    // draw groups with drawIndexedIndirect() from indirectBuffer_ so their arguments can be
+    // written on the GPU.
+    bool indirectDraws_ = false;
+    // frustum cull instances in a compute pass, needs indirect draws.
+    bool gpuCulling_ = false;
+    // the device has indirect-first-instance, which indirect draws need
+    bool indirectFirstInstance_ = false;
+    // the device may be used from several threads, recording on workers needs it
+    bool threadSafeDevice_ = false;
+    // frustum cull drawables before they are queued, only visible ones are uploaded.
+    bool cpuCulling_ = false;
 
     bool freezeAnimation_ = false;  // unused at present
     
@@ -221,6 +372,111 @@ protected:
     RenderTimingContext timing_;
     FpsMonitor fpsMonitor_;
 
+    // The drawables are put in a render queue sorted by state and depth.  Runs with the
+    // same pipeline, material bindings and mesh are drawn with one instanced draw, their instance
+    // data is laid out contiguously in instanceBuffer_ in queue order.
+    class DrawGroup {
+    public:
+        wgpu::RenderPipeline pipeline;
+        wgpu::BindGroup bindings;
+        DrawableMesh *mesh;
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+    };
+    RenderQueue renderQueue_;  // items are indices in snapshot_->drawables
+    std::vector<DrawGroup> drawGroups_;
+    // per frame ids for the sort keys
+    std::unordered_map<void*,uint32_t> pipelineIds_;
+    std::unordered_map<void*,uint32_t> bindingsIds_;
+    std::unordered_map<void*,uint32_t> bufferIds_;
+    std::unordered_map<void*,uint32_t> meshIds_;
+    FrustumCuller culler_;
+    std::vector<uint32_t> visibleDrawables_;  // indices in snapshot_->drawables to queue
+
+    // The frame is rendered from a snapshot of the scene taken after the simulation step.
+    // When pipelined the step for the next frame runs on simThread_ while this one is
+    // rendered, it fills the other snapshot.  The counters hand them over, each side
+    // only waits when it gets a frame ahead of the other.
+    SceneSnapshot snapshots_[2];
+    SceneSnapshot *snapshot_ = &snapshots_[0];  // being rendered
+    uint32_t lastDrawListVersion_ = ~0u;
+    bool pipelined_ = false;
+    class SimulationRunner;
+    ObjectPtr<Thread> simThread_;
+    std::atomic<bool> simRunning_{false};
+    std::atomic<uint64_t> simFrames_{0};       // snapshots published by simThread_
+    std::atomic<uint64_t> releasedFrames_{0};  // snapshots the render thread is done with
+    uint64_t acquiredFrames_ = 0;
+    WaitableSignal snapshotPublished_;
+    WaitableSignal snapshotReleased_;
+    RenderTimingContext simTiming_;
+
+    void captureSnapshot(SceneSnapshot &snap);
+    bool acquireSnapshot();
+    void stopSimulation();
+
+    void cullDrawables(const Matrix4f &vp);
+    wgpu::ShaderModule sceneShaderVariant(uint32_t features);
+    void updateLightFeatures();
+    void captureMaterialState(Material *mat, SceneSnapshot::MaterialState &state);
+    wgpu::RenderPipeline pipelineFor(const SceneSnapshot::MaterialState &state);
+    void buildRenderQueue();
+
+    // The opaque draws recorded in render bundles and replayed while the draw list is
+    // unchanged, the per frame data they read is in the uploaded buffers.  Large draw
+    // lists are split into a bundle per contiguous range of groups, recorded in parallel.
+    std::vector<wgpu::RenderBundle> opaqueBundles_;
+    std::unique_ptr<WorkerPool> encodeWorkers_;
+    int encodeThreads_ = 1;
+    bool drawListDirty_ = true;
+    bool bundleIndirect_ = false;
+    uint32_t bundleRelocations_ = 0;
+    std::vector<DrawGroup> bundleGroups_;
+
+    // What was last uploaded to each slot of the instance, material and light arrays.
+    // Only slots that changed are uploaded, the rest stay as they are on the GPU.
+    class InstanceSlot {
+    public:
+        MeshNode *node;
+        uint32_t drawable;  // index in Scene::drawables_, the objectId
+        int worldStamp;
+        int32_t materialIx;
+    };
+    class MaterialSlot {
+    public:
+        Material *material;
+        uint32_t dataStamp;
+    };
+    class LightSlot {
+    public:
+        LightNode *light;
+        int worldStamp;
+        uint32_t dataStamp;
+    };
+    std::vector<InstanceSlot> instanceSlots_;
+    std::vector<MaterialSlot> materialSlots_;
+    std::vector<LightSlot> lightSlots_;
+    DirtyRanges dirtyRanges_;
+    LightClusters lightClusters_;
+    Matrix4f clusterView_;        // lightClusters_ was built for
+    Matrix4f clusterProjection_;
+    bool uploadAll_ = true;  // after scene changes or an upload that could not be staged
+
+    uint32_t ensureCapacity(ObjectPtr<BufferChunk> &chunk, uint32_t count, uint32_t elementSize);
+    uint32_t ensureInstanceCapacity(uint32_t count);
+    void uploadMaterials();
+    void uploadInstances();
+    template<class T>
+    bool writeInstances();
+    bool uploadLights();
+    void uploadLightClusters(bool lightsChanged);
+
+    template<class EncoderT>
+    bool encodeDraws(EncoderT &encoder, size_t begin, size_t end);
+    bool opaqueBundleValid();
+    void releaseOpaqueBundles();
+    void recordOpaqueBundles();
+
     ObjectPtr<Scene> currentScene_;
 
     ObjectPtr<Material> defaultMaterial_;
@@ -268,7 +524,7 @@ protected:
 
 public:
 
-    int init(bool headless, int width, int height);
+    int init(bool headless, int width, int height, LimitsProfile limits = LimitsBalanced);
     int renderFrame();
     INL const TimingContext &timing() const { return(timing_); }
     void releaseResources();
@@ -279,6 +535,29 @@ public:
     void setCurrentScene(ObjectPtr<Scene> scene) {
         currentScene_ = scene;
     }
+    // refused when the device has no indirect-first-instance
+    void setIndirectDraws(bool on);
+    void setGpuCulling(bool on);
+    INL void setCpuCulling(bool on) {
+        cpuCulling_ = on;
+    }
+    void setEncodeThreads(int count);
+    void setPipelined(bool on);
+    INL void setCacheDirectory(const char *path) {
+        cacheDirectory_ = path ? path : "";
+    }
+    void setInstanceFormat(GpuEngine::InstanceFormat format);
+    // bytes of an instance in the instance array
+    uint32_t instanceStride() const;
+    // the ShaderManager::Feature bit of the instance format
+    uint32_t instanceFeatures() const;
+    // body of simThread_
+    void simulationLoop();
+    // drawables, meshes or bindings changed so the recorded draws need to be re-recorded.
+    INL void invalidateDrawList() {
+        drawListDirty_ = true;
+        uploadAll_ = true;
+    }
 
 };
 
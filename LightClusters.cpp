@@ -0,0 +1,130 @@
+#include "./LightClusters.h"
+#include "artd/LightNode.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+ARTD_BEGIN
+
+static uint32_t clampCell(float v, uint32_t count) {
+    if(!(v > 0.0f)) {
+        return(0);
+    }
+    uint32_t cell = (uint32_t)v;
+    return(cell < count ? cell : count - 1);
+}
+
+// The clusters the light's sphere can reach, from the corners of its view space box
+// cut to the clip planes.  The box is convex so its projection is inside theirs.
+bool
+LightClusters::bounds(const Matrix4f &view, const Matrix4f &projection, float nearClip, float farClip,
+                      const glm::vec3 &center, float radius, Range &out) const {
+
+    glm::vec4 c = view * glm::vec4(center, 1.0f);
+    float depth = -c.z;  // the camera looks down -z
+    float d0 = std::max(depth - radius, nearClip);
+    float d1 = std::min(depth + radius, farClip);
+    if(d0 > d1) {
+        return(false);
+    }
+
+    float x0 = FLT_MAX, x1 = -FLT_MAX;
+    float y0 = FLT_MAX, y1 = -FLT_MAX;
+    for(int i = 0; i < 8; ++i) {
+        float x = c.x + ((i & 1) ? radius : -radius);
+        float y = c.y + ((i & 2) ? radius : -radius);
+        float d = (i & 4) ? d1 : d0;
+        glm::vec4 clip = projection * glm::vec4(x, y, -d, 1.0f);
+        float nx = clip.x / clip.w;
+        float ny = clip.y / clip.w;
+        x0 = std::min(x0, nx);
+        x1 = std::max(x1, nx);
+        y0 = std::min(y0, ny);
+        y1 = std::max(y1, ny);
+    }
+    if(x1 < -1.0f || x0 > 1.0f || y1 < -1.0f || y0 > 1.0f) {
+        return(false);
+    }
+    out.x0 = clampCell((x0 * 0.5f + 0.5f) * TilesX, TilesX);
+    out.x1 = clampCell((x1 * 0.5f + 0.5f) * TilesX, TilesX);
+    // framebuffer y runs down
+    out.y0 = clampCell((0.5f - y1 * 0.5f) * TilesY, TilesY);
+    out.y1 = clampCell((0.5f - y0 * 0.5f) * TilesY, TilesY);
+    out.z0 = clampCell(std::log(d0) * sliceScale_ + sliceBias_, Slices);
+    out.z1 = clampCell(std::log(d1) * sliceScale_ + sliceBias_, Slices);
+    return(true);
+}
+
+void
+LightClusters::build(const Matrix4f &view, const Matrix4f &projection, float nearClip, float farClip,
+                     const std::vector<SceneSnapshot::LightEntry> &lights, uint32_t count) {
+
+    clusters_.assign(ClusterCount, { 0, 0 });
+    indices_.clear();
+    ranges_.clear();
+
+    // an orthographic projection has no w from depth, everything is shaded everywhere
+    bool perspective = projection[2][3] != 0.0f && nearClip > 0.0f && farClip > nearClip;
+    if(perspective) {
+        float logRatio = std::log(farClip / nearClip);
+        sliceScale_ = Slices / logRatio;
+        sliceBias_ = -(float)Slices * std::log(nearClip) / logRatio;
+    } else {
+        sliceScale_ = 0;
+        sliceBias_ = 0;
+    }
+
+    for(uint32_t i = 0; i < count; ++i) {
+        const LightShaderData &data = lights[i].data;
+        bool local = data.type_ == LightNode::point || data.type_ == LightNode::spot;
+        if(!local || !perspective) {
+            indices_.push_back(i);
+            continue;
+        }
+        float radius = data.vec0_.y;
+        Range range;
+        if(radius > 0.0f && bounds(view, projection, nearClip, farClip, glm::vec3(data.pose_[3]), radius, range)) {
+            range.light = i;
+            ranges_.push_back(range);
+        }
+    }
+    globalCount_ = (uint32_t)indices_.size();
+
+    // count, lay the runs out, then fill them
+    for(const Range &r : ranges_) {
+        for(uint32_t z = r.z0; z <= r.z1; ++z) {
+            for(uint32_t y = r.y0; y <= r.y1; ++y) {
+                for(uint32_t x = r.x0; x <= r.x1; ++x) {
+                    ++clusters_[x + TilesX * (y + TilesY * z)].count;
+                }
+            }
+        }
+    }
+    uint32_t offset = globalCount_;
+    for(LightCluster &cluster : clusters_) {
+        cluster.offset = offset;
+        offset += cluster.count;
+        cluster.count = 0;
+    }
+    indices_.resize(offset);
+    for(const Range &r : ranges_) {
+        for(uint32_t z = r.z0; z <= r.z1; ++z) {
+            for(uint32_t y = r.y0; y <= r.y1; ++y) {
+                for(uint32_t x = r.x0; x <= r.x1; ++x) {
+                    LightCluster &cluster = clusters_[x + TilesX * (y + TilesY * z)];
+                    indices_[cluster.offset + cluster.count++] = r.light;
+                }
+            }
+        }
+    }
+}
+
+void
+LightClusters::dropLocal() {
+    for(LightCluster &cluster : clusters_) {
+        cluster = { globalCount_, 0 };
+    }
+    indices_.resize(globalCount_);
+}
+
+ARTD_END
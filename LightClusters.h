@@ -0,0 +1,81 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include "artd/vecmath.h"
+#include "./SceneSnapshot.h"
+#include <cstdint>
+#include <vector>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// a cluster's run in the light index list
+struct LightCluster {
+    uint32_t offset;
+    uint32_t count;
+};
+
+static_assert(sizeof(LightCluster) == 8);
+
+// Bins the local lights of a frame into a grid of view space clusters, screen tiles
+// by depth slices spaced exponentially between the clip planes, so a fragment only
+// shades the lights that reach its cluster.  The light index list starts with the
+// lights every fragment shades, directional and ambient ones, then has each
+// cluster's run.  The grid is the one in testShader1.wgsl.
+
+class LightClusters
+{
+public:
+    static const uint32_t TilesX = 16;
+    static const uint32_t TilesY = 9;
+    static const uint32_t Slices = 24;
+    static const uint32_t ClusterCount = TilesX * TilesY * Slices;
+
+private:
+    class Range {
+    public:
+        uint32_t light;
+        uint32_t x0, x1, y0, y1, z0, z1;  // inclusive
+    };
+
+    std::vector<LightCluster> clusters_;
+    std::vector<uint32_t> indices_;
+    std::vector<Range> ranges_;
+    uint32_t globalCount_ = 0;
+    float sliceScale_ = 0;
+    float sliceBias_ = 0;
+
+    bool bounds(const Matrix4f &view, const Matrix4f &projection, float nearClip, float farClip,
+                const glm::vec3 &center, float radius, Range &out) const;
+
+public:
+
+    // lights[0, count) with the view and projection they are rendered with
+    void build(const Matrix4f &view, const Matrix4f &projection, float nearClip, float farClip,
+               const std::vector<SceneSnapshot::LightEntry> &lights, uint32_t count);
+
+    // leaves only the lights every fragment shades
+    void dropLocal();
+
+    INL const std::vector<LightCluster> &clusters() const {
+        return(clusters_);
+    }
+    INL const std::vector<uint32_t> &indices() const {
+        return(indices_);
+    }
+    INL uint32_t globalCount() const {
+        return(globalCount_);
+    }
+    // slice = log(view depth) * scale + bias
+    INL float sliceScale() const {
+        return(sliceScale_);
+    }
+    INL float sliceBias() const {
+        return(sliceBias_);
+    }
+};
+
+#undef INL
+
+ARTD_END
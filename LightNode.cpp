@@ -65,6 +65,7 @@ LightNode::setAreaWrap(float v)
     else if(v > 1.0)
     v = 1.0;
     data_.vec0_.x = v * 4.f;  // note this is 0 to 4 passed into shader !
+    ++dataStamp_;
 }
 
 
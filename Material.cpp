@@ -29,6 +29,11 @@ Material::setDiffuseTexture(StringArg resPath) {
     e->textureManager_->loadBindableTexture(resPath, [pMat,e](ObjectPtr<TextureView> tView) {
             pMat->setDiffuseTex(tView);
             pMat->bindings_ = e->createMaterialBindGroup(pMat);
+            // picked up with the next snapshot, as for a MeshNode's changes
+            Scene *s = e->currentScene_.get();
+            if(s) {
+                ++s->drawListVersion_;
+            }
         });
 }
 
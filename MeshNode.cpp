@@ -14,9 +14,10 @@ MeshNode::~MeshNode() {
 void
 MeshNode::setMaterial(ObjectPtr<Material> newMat) {
     material_ = newMat;
-    if(newMat) {
-        Scene *s = getScene();
-        if(s) {
+    Scene *s = getScene();
+    if(s) {
+        ++s->drawListVersion_;
+        if(newMat) {
             s->addActiveMaterial(newMat.get());
         }
     }
@@ -25,6 +26,10 @@ MeshNode::setMaterial(ObjectPtr<Material> newMat) {
 void
 MeshNode::setMesh(ObjectPtr<DrawableMesh> mesh) {
     mesh_ = mesh;
+    Scene *s = getScene();
+    if(s) {
+        ++s->drawListVersion_;
+    }
 }
 
 void
@@ -37,14 +42,5 @@ MeshNode::setMesh(StringArg resPath) {
     setMesh(mesh);
 }
 
-void
-MeshNode::loadInstanceData(struct InstanceData &data) {
-    data.modelMatrix = getLocalToWorldTransform();
-    data.materialId = 0;
-    if(material_) {
-        data.materialId = material_->getIndex();
-    }
-}
-
 
 ARTD_END
@@ -0,0 +1,256 @@
+#include "GpuEngineImpl.h"
+#include "./PipelineCache.h"
+#include "artd/DrawableMesh.h"
+#include <chrono>
+#include <thread>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+using namespace wgpu;
+
+static INL uint64_t hashIn(uint64_t h, uint64_t v) {
+    // FNV-1a a byte at a time so padding in the key is never read
+    for(int i = 0; i < 8; ++i) {
+        h ^= (v >> (i * 8)) & 0xff;
+        h *= 0x100000001b3ull;
+    }
+    return(h);
+}
+
+uint64_t
+PipelineKey::hash() const {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = hashIn(h, (uint64_t)(uintptr_t)module);
+    h = hashIn(h, vertexLayout);
+    h = hashIn(h, blend);
+    h = hashIn(h, (uint64_t)cullMode);
+    h = hashIn(h, (uint64_t)depthCompare);
+    h = hashIn(h, depthWrite ? 1 : 0);
+    h = hashIn(h, (uint64_t)colorFormat);
+    h = hashIn(h, (uint64_t)depthFormat);
+    return(h);
+}
+
+bool
+PipelineKey::operator==(const PipelineKey &other) const {
+    return(module == other.module
+           && vertexLayout == other.vertexLayout
+           && blend == other.blend
+           && cullMode == other.cullMode
+           && depthCompare == other.depthCompare
+           && depthWrite == other.depthWrite
+           && colorFormat == other.colorFormat
+           && depthFormat == other.depthFormat);
+}
+
+class PipelineCache::Entry {
+public:
+    RenderPipeline pipeline = nullptr;  // null until created, or if that failed
+    bool done = true;       // false while its creation is pending
+    bool orphaned = false;  // the cache is gone, the callback releases the pipeline
+};
+
+// Handed to an async creation and freed by its callback, along with the entry if the
+// cache no longer has it.
+class PipelineCache::Creation {
+public:
+    std::shared_ptr<int> pending;
+    std::shared_ptr<Entry> entry;
+};
+
+// A RenderPipelineDescriptor for a key along with the states it points to.
+class PipelineDescription {
+public:
+    VertexAttribute vertexAttribs[3];
+    VertexBufferLayout vertexBufferLayout;
+    BlendState blendState;
+    ColorTargetState colorTarget;
+    FragmentState fragmentState;
+    DepthStencilState depthStencilState = Default;
+    RenderPipelineDescriptor desc;
+
+    PipelineDescription(const PipelineKey &key, PipelineLayout layout) {
+
+        // position, normal, uv
+        vertexAttribs[0].shaderLocation = 0;
+        vertexAttribs[0].format = VertexFormat::Float32x3;
+        vertexAttribs[0].offset = 0;
+
+        vertexAttribs[1].shaderLocation = 1;
+        vertexAttribs[1].format = VertexFormat::Float32x3;
+        vertexAttribs[1].offset = offsetof(GpuVertexAttributes, normal);
+
+        vertexAttribs[2].shaderLocation = 2;
+        vertexAttribs[2].format = VertexFormat::Float32x2;
+        vertexAttribs[2].offset = offsetof(GpuVertexAttributes, uv);
+
+        vertexBufferLayout.attributeCount = 3;
+        vertexBufferLayout.attributes = vertexAttribs;
+        vertexBufferLayout.arrayStride = sizeof(GpuVertexAttributes);
+        vertexBufferLayout.stepMode = VertexStepMode::Vertex;
+
+        desc.label = "Scene pipeline";
+        desc.layout = layout;
+        desc.vertex.bufferCount = 1;
+        desc.vertex.buffers = &vertexBufferLayout;
+        desc.vertex.module = key.module;
+        desc.vertex.entryPoint = "vs_main";
+        desc.vertex.constantCount = 0;
+        desc.vertex.constants = nullptr;
+
+        desc.primitive.topology = PrimitiveTopology::TriangleList;
+        desc.primitive.stripIndexFormat = IndexFormat::Undefined;
+        desc.primitive.frontFace = FrontFace::CCW;  // right handed convention
+        desc.primitive.cullMode = key.cullMode;
+
+        switch(key.blend) {
+            case PipelineKey::BlendAlpha:
+                blendState.color.srcFactor = BlendFactor::SrcAlpha;
+                blendState.color.dstFactor = BlendFactor::OneMinusSrcAlpha;
+                break;
+            case PipelineKey::BlendAdditive:
+                blendState.color.srcFactor = BlendFactor::One;
+                blendState.color.dstFactor = BlendFactor::One;
+                break;
+            default:
+                blendState.color.srcFactor = BlendFactor::One;
+                blendState.color.dstFactor = BlendFactor::Zero;
+                break;
+        }
+        blendState.color.operation = BlendOperation::Add;
+        // the target alpha is left as is
+        blendState.alpha.srcFactor = BlendFactor::Zero;
+        blendState.alpha.dstFactor = BlendFactor::One;
+        blendState.alpha.operation = BlendOperation::Add;
+
+        colorTarget.format = key.colorFormat;
+        colorTarget.blend = &blendState;
+        colorTarget.writeMask = ColorWriteMask::All;
+
+        fragmentState.module = key.module;
+        fragmentState.entryPoint = "fs_main";
+        fragmentState.constantCount = 0;
+        fragmentState.constants = nullptr;
+        fragmentState.targetCount = 1;
+        fragmentState.targets = &colorTarget;
+        desc.fragment = &fragmentState;
+
+        depthStencilState.depthCompare = key.depthCompare;
+        depthStencilState.depthWriteEnabled = key.depthWrite;
+        depthStencilState.format = key.depthFormat;
+        depthStencilState.stencilReadMask = 0;
+        depthStencilState.stencilWriteMask = 0;
+        desc.depthStencil = &depthStencilState;
+
+        desc.multisample.count = 1;
+        desc.multisample.mask = ~0u;
+        desc.multisample.alphaToCoverageEnabled = false;
+    }
+};
+
+PipelineCache::PipelineCache(GpuEngineImpl *owner, PipelineLayout layout)
+    : owner_(*owner), device_(owner->device()), layout_(layout)
+{}
+
+PipelineCache::~PipelineCache() {
+    waitForPending();
+    for(auto &it : entries_) {
+        Entry &entry = *it.second;
+        if(entry.pipeline) {
+            entry.pipeline.release();
+        } else if(!entry.done) {
+            // its callback has the entry and frees it
+            entry.orphaned = true;
+        }
+    }
+    entries_.clear();
+    fallback_ = nullptr;
+    layout_.release();
+}
+
+// The completions are delivered by device ticks, they are given some time to arrive
+// before the cache goes.
+void
+PipelineCache::waitForPending() {
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while(*pending_ > 0 && std::chrono::steady_clock::now() < until) {
+#ifdef WEBGPU_BACKEND_WGPU
+        wgpuDevicePoll(device_, true, nullptr);
+#else
+        device_.tick();
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if(*pending_ > 0) {
+        AD_LOG(error) << *pending_ << " pipelines still compiling, their callbacks free them";
+    }
+}
+
+RenderPipeline
+PipelineCache::createNow(const PipelineKey &key) {
+
+    std::shared_ptr<Entry> &slot = entries_[key];
+    if(!slot) {
+        slot = std::make_shared<Entry>();
+    }
+    Entry &entry = *slot;
+    if(!entry.pipeline) {
+        PipelineDescription description(key, layout_);
+        entry.pipeline = device_.createRenderPipeline(description.desc);
+    }
+    return(entry.pipeline);
+}
+
+void
+PipelineCache::setFallback(const PipelineKey &key) {
+    RenderPipeline pipeline = createNow(key);
+    if(!pipeline) {
+        AD_LOG(error) << "could not create the fallback pipeline";
+        return;
+    }
+    fallback_ = pipeline;
+}
+
+RenderPipeline
+PipelineCache::get(const PipelineKey &key) {
+
+    std::shared_ptr<Entry> &slot = entries_[key];
+    if(slot) {
+        return(slot->pipeline ? slot->pipeline : fallback_);
+    }
+    slot = std::make_shared<Entry>();
+    slot->done = false;
+    ++*pending_;
+
+    // through the C call so the callback can free what it is given once it has run
+    PipelineDescription description(key, layout_);
+    Creation *creation = new Creation{ pending_, slot };
+    wgpuDeviceCreateRenderPipelineAsync(device_, &description.desc, &PipelineCache::onCreated, creation);
+    return(slot->pipeline ? slot->pipeline : fallback_);
+}
+
+void
+PipelineCache::onCreated(WGPUCreatePipelineAsyncStatus status, WGPURenderPipeline pipeline,
+                         char const *message, void *userdata) {
+
+    std::unique_ptr<Creation> creation(static_cast<Creation *>(userdata));
+    Entry &entry = *creation->entry;
+    --*creation->pending;
+    entry.done = true;
+    if(status == WGPUCreatePipelineAsyncStatus_Success) {
+        // gone, or made by createNow() meanwhile
+        if(entry.orphaned || entry.pipeline) {
+            wgpuRenderPipelineRelease(pipeline);
+            return;
+        }
+        entry.pipeline = pipeline;
+    } else {
+        AD_LOG(error) << "pipeline creation failed: " << (message ? message : "");
+    }
+}
+
+#undef INL
+
+ARTD_END
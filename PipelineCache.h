@@ -0,0 +1,95 @@
+#pragma once
+
+#include "artd/gpu_engine.h"
+#include "artd/ObjectBase.h"
+#include <webgpu/webgpu.hpp>
+#include <memory>
+#include <unordered_map>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+class GpuEngineImpl;
+
+// The state a render pipeline is made from that differs between variants.  The
+// shader module has the entry points vs_main and fs_main, the layout is the cache's.
+class PipelineKey {
+public:
+    enum BlendMode {
+        BlendNone = 0,
+        BlendAlpha,     // source alpha over, target alpha kept
+        BlendAdditive,
+    };
+    enum VertexLayout {
+        VertexStandard = 0,  // GpuVertexAttributes, position normal uv
+    };
+
+    WGPUShaderModule module = nullptr;
+    uint32_t vertexLayout = VertexStandard;
+    uint32_t blend = BlendNone;
+    WGPUCullMode cullMode = WGPUCullMode_Back;
+    WGPUCompareFunction depthCompare = WGPUCompareFunction_Less;
+    bool depthWrite = true;
+    WGPUTextureFormat colorFormat = WGPUTextureFormat_Undefined;
+    WGPUTextureFormat depthFormat = WGPUTextureFormat_Undefined;
+
+    uint64_t hash() const;
+    bool operator==(const PipelineKey &other) const;
+
+    class Hasher {
+    public:
+        INL size_t operator()(const PipelineKey &key) const {
+            return((size_t)key.hash());
+        }
+    };
+};
+
+// Render pipelines by their key.  One asked for the first time is created with
+// createRenderPipelineAsync and the fallback is handed out until it is ready, so a new
+// variant never stalls a frame on its compile.  The completions arrive from device
+// ticks on the render thread.
+class ARTD_API_GPU_ENGINE PipelineCache {
+
+    class Entry;
+    class Creation;
+
+    GpuEngineImpl &owner_;
+    wgpu::Device device_;
+    wgpu::PipelineLayout layout_;
+    // a creation in progress shares its entry, so one the cache lets go of lives until it completes
+    std::unordered_map<PipelineKey, std::shared_ptr<Entry>, PipelineKey::Hasher> entries_;
+    wgpu::RenderPipeline fallback_ = nullptr;  // one of the entries
+    // creations not completed, the callbacks share it so they never write into the cache
+    std::shared_ptr<int> pending_ = std::make_shared<int>(0);
+
+    void waitForPending();
+    static void onCreated(WGPUCreatePipelineAsyncStatus status, WGPURenderPipeline pipeline,
+                          char const *message, void *userdata);
+
+public:
+
+    // takes over the layout
+    PipelineCache(GpuEngineImpl *owner, wgpu::PipelineLayout layout);
+    ~PipelineCache();
+
+    INL GpuEngineImpl &getOwner() {
+        return(owner_);
+    }
+    // pipelines still compiling
+    INL int pendingCount() const {
+        return(*pending_);
+    }
+
+    // creates the pipeline before returning, for one that has to be there from the start
+    wgpu::RenderPipeline createNow(const PipelineKey &key);
+    // the pipeline returned in place of ones not ready, created now
+    void setFallback(const PipelineKey &key);
+    // the pipeline for key if ready, otherwise the fallback and its creation is started
+    // if it was not.  Ones that failed to compile keep getting the fallback.
+    wgpu::RenderPipeline get(const PipelineKey &key);
+};
+
+#undef INL
+
+ARTD_END
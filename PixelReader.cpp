@@ -8,7 +8,7 @@ std::filesystem::path resolvePath(int frame) {
 	return std::filesystem::absolute(base);
 }
 
-PixelReader::PixelReader(wgpu::Device device, uint32_t width, uint32_t height)
+PixelReader::PixelReader(wgpu::Device device, ShaderManager &shaders, uint32_t width, uint32_t height)
 	: device_(device)
 	, width_(width)
 	, height_(height)
@@ -44,36 +44,8 @@ PixelReader::PixelReader(wgpu::Device device, uint32_t width, uint32_t height)
 	pixelBufferDesc.size = 4 * width * height;
 	Buffer pixelBuffer = device.createBuffer(pixelBufferDesc);
 
-	// Shader
-	ShaderModuleWGSLDescriptor shaderCodeDesc{};
-	shaderCodeDesc.chain.next = nullptr;
-	shaderCodeDesc.chain.sType = SType::ShaderModuleWGSLDescriptor;
-	shaderCodeDesc.code = R"(
-var<private> pos : array<vec2<f32>, 3> = array<vec2<f32>, 3>(
-	vec2<f32>(-1.0, -1.0), vec2<f32>(-1.0, 3.0), vec2<f32>(3.0, -1.0)
-);
-
-@group(0) @binding(0) var texture: texture_2d<f32>;
-
-@vertex
-fn vs_main(@builtin(vertex_index) vertexIndex: u32) -> @builtin(position) vec4<f32> {
-	return vec4(pos[vertexIndex], 1.0, 1.0);
-}
-
-@fragment
-fn fs_main(@builtin(position) fragCoord: vec4<f32>) -> @location(0) vec4<f32> {
-	let color = textureLoad(texture, vec2<i32>(fragCoord.xy), 0);
-	let corrected_color = pow(color.rgb, vec3<f32>(1.0/2.2));
-	return vec4<f32>(corrected_color, color.a);
-}
-)";
-	ShaderModuleDescriptor shaderDesc{};
-#ifdef WEBGPU_BACKEND_WGPU
-	shaderDesc.hintCount = 0;
-	shaderDesc.hints = nullptr;
-#endif
-	shaderDesc.nextInChain = &shaderCodeDesc.chain;
-	ShaderModule shaderModule = device.createShaderModule(shaderDesc);
+	// Shader, shared with readers made before
+	ShaderModule shaderModule = shaders.loadShaderModule("pixelReaderBlit.wgsl");
 
 	// Bind group for input texture
 	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(1, Default);
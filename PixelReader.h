@@ -5,12 +5,13 @@
 #include <filesystem>
 #include <string>
 #include "artd/jlib_base.h"
+#include "artd/ShaderManager.h"
 
 ARTD_BEGIN
 
 class PixelReader {
 public:
-	PixelReader(wgpu::Device device, uint32_t width, uint32_t height);
+	PixelReader(wgpu::Device device, ShaderManager &shaders, uint32_t width, uint32_t height);
 	// bool render(const std::filesystem::path path, wgpu::TextureView textureView) const;
     bool lockPixels(uint32_t **pPixelsOut, wgpu::Texture texture) const;
     void unlockPixels();
@@ -0,0 +1,416 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// Two level segregated fit ( TLSF like ) allocator for sub-allocating ranges
+// out of a single larger buffer.  It only manages offsets and sizes. The memory
+// itself lives on the GPU so the block "headers" are kept here on the CPU side
+// in a physically ordered list so neighbors can be coalesced in O(1).
+//
+// see: http://www.gii.upv.es/tlsf/files/papers/ecrts04_tlsf.pdf
+//
+// allocate() and free() are O(1), all sizes and offsets are multiples of the granularity.
+
+class RangeAllocator
+{
+public:
+
+    class Block {
+        friend class RangeAllocator;
+
+        uint32_t offset_ = 0;
+        uint32_t size_ = 0;
+        Block *prevPhys_ = nullptr;
+        Block *nextPhys_ = nullptr;
+        Block *prevFree_ = nullptr;
+        Block *nextFree_ = nullptr;
+        bool free_ = false;
+    public:
+        void *user_ = nullptr;  // owner of allocated block
+
+        INL uint32_t offset() const {
+            return(offset_);
+        }
+        INL uint32_t size() const {
+            return(size_);
+        }
+        INL uint32_t endOffset() const {
+            return(offset_ + size_);
+        }
+        INL bool isFree() const {
+            return(free_);
+        }
+        INL Block *nextPhys() const {
+            return(nextPhys_);
+        }
+    };
+
+private:
+
+    static const int SlBits = 4;
+    static const int SlCount = 1 << SlBits;
+    static const int FlShift = SlBits + 2;  // below this blocks are binned linearly
+    static const uint32_t SmallSize = 1u << FlShift;
+    static const int FlCount = 32 - FlShift + 1;
+    static const int NodesPerSlab = 64;
+
+    uint32_t capacity_;
+    uint32_t granularity_;
+    uint32_t freeBytes_;
+    int freeCount_ = 0;
+
+    uint32_t flBitmap_ = 0;
+    uint32_t slBitmap_[FlCount];
+    Block *freeLists_[FlCount][SlCount];
+
+    Block *firstPhys_ = nullptr;
+    Block *lastPhys_ = nullptr;
+    Block *spareNodes_ = nullptr;
+    std::vector<std::unique_ptr<Block[]>> nodeSlabs_;
+
+    // index of lowest set bit
+    static INL int ffs(uint32_t v) {
+#ifdef _MSC_VER
+        unsigned long ix;
+        _BitScanForward(&ix, v);
+        return((int)ix);
+#else
+        return(__builtin_ctz(v));
+#endif
+    }
+    // index of highest set bit
+    static INL int fls(uint32_t v) {
+#ifdef _MSC_VER
+        unsigned long ix;
+        _BitScanReverse(&ix, v);
+        return((int)ix);
+#else
+        return(31 - __builtin_clz(v));
+#endif
+    }
+
+    static INL void mapping(uint32_t size, int &fl, int &sl) {
+        if(size < SmallSize) {
+            fl = 0;
+            sl = (int)(size / (SmallSize / SlCount));
+        } else {
+            int f = fls(size);
+            sl = (int)(size >> (f - SlBits)) ^ SlCount;
+            fl = f - (FlShift - 1);
+        }
+    }
+
+    Block *newNode() {
+        if(!spareNodes_) {
+            Block *slab = new Block[NodesPerSlab];
+            nodeSlabs_.emplace_back(slab);
+            for(int i = 0; i < NodesPerSlab; ++i) {
+                slab[i].nextFree_ = spareNodes_;
+                spareNodes_ = &slab[i];
+            }
+        }
+        Block *b = spareNodes_;
+        spareNodes_ = b->nextFree_;
+        *b = Block();
+        return(b);
+    }
+
+    INL void releaseNode(Block *b) {
+        b->nextFree_ = spareNodes_;
+        spareNodes_ = b;
+    }
+
+    void insertFree(Block *b) {
+        int fl, sl;
+        mapping(b->size_, fl, sl);
+        Block *head = freeLists_[fl][sl];
+        b->free_ = true;
+        b->prevFree_ = nullptr;
+        b->nextFree_ = head;
+        if(head) {
+            head->prevFree_ = b;
+        }
+        freeLists_[fl][sl] = b;
+        flBitmap_ |= (1u << fl);
+        slBitmap_[fl] |= (1u << sl);
+        ++freeCount_;
+    }
+
+    void removeFree(Block *b) {
+        int fl, sl;
+        mapping(b->size_, fl, sl);
+        if(b->prevFree_) {
+            b->prevFree_->nextFree_ = b->nextFree_;
+        } else {
+            freeLists_[fl][sl] = b->nextFree_;
+            if(!b->nextFree_) {
+                slBitmap_[fl] &= ~(1u << sl);
+                if(!slBitmap_[fl]) {
+                    flBitmap_ &= ~(1u << fl);
+                }
+            }
+        }
+        if(b->nextFree_) {
+            b->nextFree_->prevFree_ = b->prevFree_;
+        }
+        b->prevFree_ = b->nextFree_ = nullptr;
+        b->free_ = false;
+        --freeCount_;
+    }
+
+    // absorb the physically next block into b
+    INL void absorbNext(Block *b) {
+        Block *next = b->nextPhys_;
+        b->size_ += next->size_;
+        b->nextPhys_ = next->nextPhys_;
+        if(b->nextPhys_) {
+            b->nextPhys_->prevPhys_ = b;
+        } else {
+            lastPhys_ = b;
+        }
+        releaseNode(next);
+    }
+
+    // split off anything past size into a new free block
+    void splitTail(Block *b, uint32_t size) {
+        if(b->size_ <= size) {
+            return;
+        }
+        Block *rest = newNode();
+        rest->offset_ = b->offset_ + size;
+        rest->size_ = b->size_ - size;
+        rest->prevPhys_ = b;
+        rest->nextPhys_ = b->nextPhys_;
+        if(rest->nextPhys_) {
+            rest->nextPhys_->prevPhys_ = rest;
+        } else {
+            lastPhys_ = rest;
+        }
+        b->nextPhys_ = rest;
+        b->size_ = size;
+
+        if(rest->nextPhys_ && rest->nextPhys_->free_) {
+            removeFree(rest->nextPhys_);
+            absorbNext(rest);
+        }
+        insertFree(rest);
+    }
+
+    Block *findFree(uint32_t size) {
+
+        // round up to the next bin so anything found there fits.
+        uint32_t rounded = size;
+        if(size >= SmallSize) {
+            rounded += (1u << (fls(size) - SlBits)) - 1;
+        }
+        int fl, sl;
+        mapping(rounded, fl, sl);
+
+        if(fl < FlCount) {
+            uint32_t slMap = slBitmap_[fl] & (~0u << sl);
+            if(!slMap) {
+                uint32_t flMap = (fl + 1 < 32) ? (flBitmap_ & (~0u << (fl + 1))) : 0;
+                if(flMap) {
+                    fl = ffs(flMap);
+                    slMap = slBitmap_[fl];
+                }
+            }
+            if(slMap) {
+                return(freeLists_[fl][ffs(slMap)]);
+            }
+        }
+
+        // nothing in the larger bins, the exact bin may still hold a fit.
+        mapping(size, fl, sl);
+        for(Block *b = freeLists_[fl][sl]; b != nullptr; b = b->nextFree_) {
+            if(b->size_ >= size) {
+                return(b);
+            }
+        }
+        return(nullptr);
+    }
+
+public:
+
+    RangeAllocator(uint32_t capacity, uint32_t granularity)
+        : capacity_(capacity & ~(granularity - 1))
+        , granularity_(granularity)
+        , freeBytes_(0)
+    {
+        std::memset(slBitmap_, 0, sizeof(slBitmap_));
+        std::memset(freeLists_, 0, sizeof(freeLists_));
+        firstPhys_ = lastPhys_ = newNode();
+        firstPhys_->size_ = capacity_;
+        if(capacity_ > 0) {
+            insertFree(firstPhys_);
+            freeBytes_ = capacity_;
+        }
+    }
+
+    INL uint32_t alignedSize(uint32_t size) const {
+        size = (size + (granularity_ - 1)) & ~(granularity_ - 1);
+        return(size ? size : granularity_);
+    }
+
+    // returns nullptr if no free range large enough
+    Block *allocate(uint32_t size) {
+        size = alignedSize(size);
+        if(size > freeBytes_) {
+            return(nullptr);
+        }
+        Block *b = findFree(size);
+        if(!b) {
+            return(nullptr);
+        }
+        removeFree(b);
+        splitTail(b, size);
+        freeBytes_ -= b->size_;
+        return(b);
+    }
+
+    void free(Block *b) {
+        if(!b || b->free_) {
+            return;
+        }
+        b->user_ = nullptr;
+        freeBytes_ += b->size_;
+
+        if(b->nextPhys_ && b->nextPhys_->free_) {
+            removeFree(b->nextPhys_);
+            absorbNext(b);
+        }
+        Block *prev = b->prevPhys_;
+        if(prev && prev->free_) {
+            removeFree(prev);
+            absorbNext(prev);
+            b = prev;
+        }
+        insertFree(b);
+    }
+
+    // grow or shrink a block in place, returns false if it can not grow
+    // because the following range is in use.
+    bool tryResize(Block *b, uint32_t newSize) {
+        newSize = alignedSize(newSize);
+        if(newSize <= b->size_) {
+            freeBytes_ += b->size_ - newSize;
+            splitTail(b, newSize);
+            return(true);
+        }
+        Block *next = b->nextPhys_;
+        uint32_t needed = newSize - b->size_;
+        if(!next || !next->free_ || next->size_ < needed) {
+            return(false);
+        }
+        removeFree(next);
+        absorbNext(b);
+        splitTail(b, newSize);
+        freeBytes_ -= needed;
+        return(true);
+    }
+
+    INL uint32_t capacity() const {
+        return(capacity_);
+    }
+    INL uint32_t granularity() const {
+        return(granularity_);
+    }
+    INL uint32_t freeBytes() const {
+        return(freeBytes_);
+    }
+    INL uint32_t usedBytes() const {
+        return(capacity_ - freeBytes_);
+    }
+    // count of free ranges including any free space at the end
+    INL int freeBlockCount() const {
+        return(freeCount_);
+    }
+    INL Block *firstBlock() const {
+        return(firstPhys_);
+    }
+    // free ranges other than the one at the end
+    INL int holeCount() const {
+        return(freeCount_ - (lastPhys_->free_ ? 1 : 0));
+    }
+    // free bytes not in the free range at the end, ie: lost to fragmentation
+    INL uint32_t holeBytes() const {
+        return(freeBytes_ - (lastPhys_->free_ ? lastPhys_->size_ : 0));
+    }
+
+    // Slide all allocated blocks down to close the holes between them leaving all the
+    // free space in a single range at the end.  onMove(block, fromOffset, toOffset)
+    // is called for each block that moves, in ascending order, so the caller can
+    // relocate the contents.
+    template<class OnMoveT>
+    void compact(OnMoveT onMove) {
+        uint32_t end = 0;
+        Block *last = nullptr;
+        for(Block *b = firstPhys_; b != nullptr;) {
+            Block *next = b->nextPhys_;
+            if(b->free_) {
+                removeFree(b);
+                releaseNode(b);
+            } else {
+                if(b->offset_ != end) {
+                    uint32_t from = b->offset_;
+                    b->offset_ = end;
+                    onMove(b, from, end);
+                }
+                b->prevPhys_ = last;
+                if(last) {
+                    last->nextPhys_ = b;
+                } else {
+                    firstPhys_ = b;
+                }
+                last = b;
+                end += b->size_;
+            }
+            b = next;
+        }
+        Block *tail = nullptr;
+        if(end < capacity_ || !last) {
+            tail = newNode();
+            tail->offset_ = end;
+            tail->size_ = capacity_ - end;
+            tail->prevPhys_ = last;
+            insertFree(tail);
+        }
+        if(last) {
+            last->nextPhys_ = tail;
+        } else {
+            firstPhys_ = tail;
+        }
+        lastPhys_ = tail ? tail : last;
+    }
+
+    uint32_t largestFreeBlock() const {
+        if(!flBitmap_) {
+            return(0);
+        }
+        int fl = fls(flBitmap_);
+        int sl = fls(slBitmap_[fl]);
+        uint32_t largest = 0;
+        for(Block *b = freeLists_[fl][sl]; b != nullptr; b = b->nextFree_) {
+            if(b->size_ > largest) {
+                largest = b->size_;
+            }
+        }
+        return(largest);
+    }
+};
+
+#undef INL
+
+ARTD_END
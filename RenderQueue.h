@@ -0,0 +1,155 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// The draws of a frame as 64 bit sort keys, radix sorted so they are encoded with
+// as few state changes as possible and front to back within them.
+//
+// key layout, most significant first:
+//
+//    pass       2 bits   opaque before transparent
+//    pipeline   6 bits
+//    bindings  14 bits   material bind group
+//    buffer     8 bits   geometry buffer the mesh is in
+//    mesh      16 bits
+//    depth     18 bits   quantized view depth, inverted for transparent
+//
+// The ids are small per frame ids handed out by the caller, not handles.
+
+class RenderQueue
+{
+public:
+
+    static const uint64_t PassOpaque = 0;
+    static const uint64_t PassTransparent = 1;
+
+    static const int DepthBits = 18;
+    static const int MeshBits = 16;
+    static const int BufferBits = 8;
+    static const int BindingsBits = 14;
+    static const int PipelineBits = 6;
+
+    static const int MeshShift = DepthBits;
+    static const int BufferShift = MeshShift + MeshBits;
+    static const int BindingsShift = BufferShift + BufferBits;
+    static const int PipelineShift = BindingsShift + BindingsBits;
+    static const int PassShift = PipelineShift + PipelineBits;
+
+    static const uint64_t StateMask = ~((1ull << DepthBits) - 1);  // all but the depth
+
+    class Entry {
+    public:
+        uint64_t key;
+        uint32_t item;  // caller's index of the draw
+        uint32_t pad_;
+    };
+
+private:
+
+    std::vector<Entry> entries_;
+    std::vector<Entry> swap_;
+
+    static INL uint64_t field(uint64_t value, int bits, int shift) {
+        uint64_t max = (1ull << bits) - 1;
+        return((value > max ? max : value) << shift);
+    }
+
+public:
+
+    // Non negative floats sort the same as their bits, the top 18 below the sign bit
+    // keep the exponent and 10 bits of mantissa.
+    static INL uint64_t quantizeDepth(float depth) {
+        if(!(depth > 0.0f)) {
+            return(0);
+        }
+        uint32_t bits;
+        ::memcpy(&bits, &depth, sizeof(bits));
+        return(bits >> (31 - DepthBits));
+    }
+
+    static INL uint64_t makeKey(uint64_t pass, uint32_t pipeline, uint32_t bindings,
+                                uint32_t buffer, uint32_t mesh, float depth) {
+        uint64_t d = quantizeDepth(depth);
+        if(pass == PassTransparent) {
+            d = ((1ull << DepthBits) - 1) - d;  // back to front
+        }
+        return(field(pass, 2, PassShift)
+             | field(pipeline, PipelineBits, PipelineShift)
+             | field(bindings, BindingsBits, BindingsShift)
+             | field(buffer, BufferBits, BufferShift)
+             | field(mesh, MeshBits, MeshShift)
+             | d);
+    }
+
+    INL void clear() {
+        entries_.clear();
+    }
+    INL void push(uint64_t key, uint32_t item) {
+        entries_.push_back({ key, item, 0 });
+    }
+    INL size_t size() const {
+        return(entries_.size());
+    }
+    INL const Entry &operator[](size_t i) const {
+        return(entries_[i]);
+    }
+    INL const std::vector<Entry> &entries() const {
+        return(entries_);
+    }
+
+    // LSD radix sort a byte at a time, stable.  Bytes all the keys have the same are
+    // skipped, with few passes and pipelines the top ones usually are.
+    void sort() {
+
+        size_t count = entries_.size();
+        if(count < 2) {
+            return;
+        }
+
+        uint32_t histograms[8][256];
+        ::memset(histograms, 0, sizeof(histograms));
+        for(const Entry &e : entries_) {
+            uint64_t key = e.key;
+            for(int b = 0; b < 8; ++b) {
+                ++histograms[b][(key >> (b * 8)) & 0xFF];
+            }
+        }
+
+        swap_.resize(count);
+        Entry *src = entries_.data();
+        Entry *dst = swap_.data();
+
+        for(int b = 0; b < 8; ++b) {
+            uint32_t *counts = histograms[b];
+            if(counts[(src[0].key >> (b * 8)) & 0xFF] == count) {
+                continue;
+            }
+            uint32_t sum = 0;
+            for(int i = 0; i < 256; ++i) {
+                uint32_t c = counts[i];
+                counts[i] = sum;
+                sum += c;
+            }
+            for(size_t i = 0; i < count; ++i) {
+                const Entry &e = src[i];
+                dst[counts[(e.key >> (b * 8)) & 0xFF]++] = e;
+            }
+            std::swap(src, dst);
+        }
+        if(src != entries_.data()) {
+            entries_.swap(swap_);
+        }
+    }
+};
+
+#undef INL
+
+ARTD_END
@@ -296,12 +296,14 @@ Scene::addDrawable(SceneNode *l) {
     Material *mat = mn->getMaterial().get();
     addActiveMaterial(mat);
     drawables_.push_back(mn);
+    ++drawListVersion_;
 }
 void
 Scene::removeDrawable(SceneNode *l) {
     for(auto it = drawables_.begin(); it != drawables_.end(); ++it) {
         if(*it == (MeshNode *)l) {
             drawables_.erase(it);
+            ++drawListVersion_;
             return;
         }
     }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "artd/jlib_base.h"
+#include "artd/ObjectBase.h"
+#include "artd/vecmath.h"
+#include "artd/Color3f.h"
+#include "artd/DrawableMesh.h"
+#include "artd/Material.h"
+#include "artd/LightNode.h"
+#include <vector>
+
+ARTD_BEGIN
+
+class MeshNode;
+
+// What a frame renders, captured from the scene graph after the simulation step so the
+// render thread does not read the scene while the next step runs.  The node and light
+// pointers are only compared, never dereferenced, they may be gone by the time the
+// frame is rendered.  Meshes and materials are held so what is drawn stays alive.
+
+class SceneSnapshot
+{
+public:
+
+    // what the pipeline and bindings a material draws with are picked from
+    class MaterialState {
+    public:
+        uint32_t features = 0;  // the ShaderManager::Feature bits it uses
+        WGPUCullMode cullMode = WGPUCullMode_Back;
+        wgpu::BindGroup bindings = nullptr;  // the material's, held by it
+    };
+
+    class Drawable {
+    public:
+        MeshNode *node;
+        uint32_t index;       // in Scene::drawables_, the objectId
+        int worldStamp;       // TransformNode world transform stamp
+        int32_t materialIx;
+        Matrix4f world;
+        ObjectPtr<DrawableMesh> mesh;
+        ObjectPtr<Material> material;
+        MaterialState materialState;  // of material, or the default one if none
+    };
+    class MaterialEntry {
+    public:
+        Material *material;
+        uint32_t dataStamp;
+        MaterialShaderData data;
+        MaterialState state;
+    };
+    class LightEntry {
+    public:
+        LightNode *light;
+        int worldStamp;
+        uint32_t dataStamp;
+        LightShaderData data;
+    };
+
+    std::vector<Drawable> drawables;    // those with a mesh
+    std::vector<MaterialEntry> materials;
+    std::vector<LightEntry> lights;
+    MaterialState defaultMaterial;
+
+    Matrix4f view;
+    Matrix4f projection;
+    float nearClip = 0;
+    float farClip = 0;
+    Matrix4f eyePose;
+    Color4f background;
+    uint32_t drawListVersion = 0;  // Scene::drawListVersion_
+
+    // keeps the vectors' storage
+    void clear() {
+        drawables.clear();
+        materials.clear();
+        lights.clear();
+    }
+};
+
+ARTD_END
@@ -25,51 +25,372 @@
  */
 
 #include "artd/ShaderManager.h"
+#include "artd/Logger.h"
+#include <cctype>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 
 ARTD_BEGIN
 
+static const char* test1Shader =
+#include "./shaders/testShader1.wgsl"
+
+static const char* cullInstancesShader =
+#include "./shaders/cullInstances.wgsl"
+
+static const char* pixelReaderBlitShader =
+#include "./shaders/pixelReaderBlit.wgsl"
+
+static const char* instanceFormatsShader =
+#include "./shaders/instanceFormats.wgsl"
+
+namespace { // anonymous local namespace
+
+// Runs the directives over a source, the directive and skipped lines are left empty
+// so line numbers in compile errors still match.
+class Preprocessor {
+    ShaderManager &manager_;
+    std::unordered_map<std::string,std::string> defines_;
+    std::string &out_;
+    bool ok_ = true;
+
+    class Branch {
+    public:
+        bool active;     // lines are emitted
+        bool taken;      // a branch of this #if was active
+        bool outerActive;
+    };
+    std::vector<Branch> branches_;
+
+    // expression parsing over one directive's text
+    const char *at_;
+
+    static bool isIdentStart(char c) {
+        return(std::isalpha((unsigned char)c) || c == '_');
+    }
+    static bool isIdentChar(char c) {
+        return(std::isalnum((unsigned char)c) || c == '_');
+    }
+    void skipSpaces() {
+        while(*at_ == ' ' || *at_ == '\t') {
+            ++at_;
+        }
+    }
+    bool accept(const char *token) {
+        skipSpaces();
+        size_t len = std::strlen(token);
+        if(std::strncmp(at_, token, len) != 0) {
+            return(false);
+        }
+        at_ += len;
+        return(true);
+    }
+    std::string identifier() {
+        skipSpaces();
+        const char *start = at_;
+        if(isIdentStart(*at_)) {
+            while(isIdentChar(*at_)) {
+                ++at_;
+            }
+        }
+        return(std::string(start, at_ - start));
+    }
+    long valueOf(const std::string &name) {
+        auto it = defines_.find(name);
+        if(it == defines_.end()) {
+            return(0);
+        }
+        return(std::strtol(it->second.c_str(), nullptr, 0));
+    }
+    long primary() {
+        skipSpaces();
+        if(accept("(")) {
+            long v = orExpr();
+            accept(")");
+            return(v);
+        }
+        if(std::isdigit((unsigned char)*at_)) {
+            char *end;
+            long v = std::strtol(at_, &end, 0);
+            at_ = end;
+            return(v);
+        }
+        std::string name = identifier();
+        if(name.empty()) {
+            ok_ = false;
+            ++at_;
+            return(0);
+        }
+        if(name == "defined") {
+            bool paren = accept("(");
+            name = identifier();
+            if(paren) {
+                accept(")");
+            }
+            return(defines_.count(name) ? 1 : 0);
+        }
+        return(valueOf(name));
+    }
+    long unary() {
+        skipSpaces();
+        if(at_[0] == '!' && at_[1] != '=') {
+            ++at_;
+            return(!unary());
+        }
+        return(primary());
+    }
+    long relational() {
+        long v = unary();
+        for(;;) {
+            if(accept("<=")) { v = v <= unary(); }
+            else if(accept(">=")) { v = v >= unary(); }
+            else if(accept("<")) { v = v < unary(); }
+            else if(accept(">")) { v = v > unary(); }
+            else { return(v); }
+        }
+    }
+    long equality() {
+        long v = relational();
+        for(;;) {
+            if(accept("==")) { v = v == relational(); }
+            else if(accept("!=")) { v = v != relational(); }
+            else { return(v); }
+        }
+    }
+    long andExpr() {
+        long v = equality();
+        while(accept("&&")) {
+            long r = equality();
+            v = v && r;
+        }
+        return(v);
+    }
+    long orExpr() {
+        long v = andExpr();
+        while(accept("||")) {
+            long r = andExpr();
+            v = v || r;
+        }
+        return(v);
+    }
+    bool evaluate(const std::string &expr) {
+        at_ = expr.c_str();
+        return(orExpr() != 0);
+    }
+
+    bool active() const {
+        return(branches_.empty() || branches_.back().active);
+    }
+
+    // replaces defined names that have a value
+    void emitLine(const std::string &line) {
+        size_t i = 0;
+        while(i < line.size()) {
+            if(line[i] == '/' && i + 1 < line.size() && line[i + 1] == '/') {
+                out_.append(line, i, std::string::npos);
+                break;
+            }
+            if(!isIdentStart(line[i])) {
+                out_ += line[i++];
+                continue;
+            }
+            size_t start = i;
+            while(i < line.size() && isIdentChar(line[i])) {
+                ++i;
+            }
+            std::string name = line.substr(start, i - start);
+            auto it = defines_.find(name);
+            if(it != defines_.end() && !it->second.empty()) {
+                out_ += it->second;
+            } else {
+                out_ += name;
+            }
+        }
+        out_ += '\n';
+    }
+
+    void directive(const std::string &line, const fs::path &path, int depth) {
+
+        at_ = line.c_str();
+        skipSpaces();
+        ++at_;  // #
+        std::string name = identifier();
+        skipSpaces();
+        std::string rest = at_;
+
+        if(name == "if" || name == "ifdef" || name == "ifndef") {
+            bool outer = active();
+            bool cond;
+            if(name == "if") {
+                cond = evaluate(rest);
+            } else {
+                at_ = rest.c_str();
+                cond = defines_.count(identifier()) != 0;
+                if(name == "ifndef") {
+                    cond = !cond;
+                }
+            }
+            branches_.push_back({ outer && cond, cond, outer });
+        } else if(name == "elif" || name == "else") {
+            if(branches_.empty()) {
+                AD_LOG(error) << path << ": #" << name << " without #if";
+                ok_ = false;
+                return;
+            }
+            Branch &b = branches_.back();
+            bool cond = !b.taken && (name == "else" || evaluate(rest));
+            b.active = b.outerActive && cond;
+            b.taken = b.taken || cond;
+        } else if(name == "endif") {
+            if(branches_.empty()) {
+                AD_LOG(error) << path << ": #endif without #if";
+                ok_ = false;
+                return;
+            }
+            branches_.pop_back();
+        } else if(!active()) {
+            return;
+        } else if(name == "define") {
+            at_ = rest.c_str();
+            std::string key = identifier();
+            skipSpaces();
+            std::string value = at_;
+            while(!value.empty() && std::isspace((unsigned char)value.back())) {
+                value.pop_back();
+            }
+            defines_[key] = value;
+        } else if(name == "undef") {
+            at_ = rest.c_str();
+            defines_.erase(identifier());
+        } else if(name == "include") {
+            size_t open = rest.find('"');
+            size_t close = rest.find('"', open + 1);
+            if(open == std::string::npos || close == std::string::npos || depth > 16) {
+                AD_LOG(error) << path << ": bad #include " << rest;
+                ok_ = false;
+                return;
+            }
+            run(rest.substr(open + 1, close - open - 1), depth + 1);
+        } else {
+            AD_LOG(error) << path << ": unknown directive #" << name;
+            ok_ = false;
+        }
+    }
+
+public:
+    Preprocessor(ShaderManager &manager, std::string &out)
+        : manager_(manager), out_(out)
+    {}
+
+    void define(const std::string &def) {
+        size_t eq = def.find('=');
+        if(eq == std::string::npos) {
+            defines_[def] = "";
+        } else {
+            defines_[def.substr(0, eq)] = def.substr(eq + 1);
+        }
+    }
+
+    bool run(const fs::path &path, int depth) {
+
+        std::string source;
+        if(!manager_.loadSource(path, source)) {
+            AD_LOG(error) << "can not read shader " << path;
+            ok_ = false;
+            return(false);
+        }
+        size_t outerBranches = branches_.size();
+        std::istringstream lines(source);
+        std::string line;
+        while(std::getline(lines, line)) {
+            size_t first = line.find_first_not_of(" \t");
+            if(first != std::string::npos && line[first] == '#') {
+                directive(line, path, depth);
+                out_ += '\n';
+            } else if(active()) {
+                emitLine(line);
+            } else {
+                out_ += '\n';
+            }
+        }
+        if(branches_.size() != outerBranches) {
+            AD_LOG(error) << path << ": #if without #endif";
+            branches_.resize(outerBranches);
+            ok_ = false;
+        }
+        return(ok_);
+    }
+};
+
+} // end namespace
+
 ShaderManager::ShaderManager(Device device)
     : device_(device)
 {
 }
 
-static const char* test1Shader =
-#include "./shaders/testShader1.wgsl"
-
-ShaderModule
-ShaderManager::loadShaderModule(const fs::path& path) {
+ShaderManager::~ShaderManager() {
+    variants_.clear();
+    for(auto &it : modules_) {
+        if(it.second.module) {
+            it.second.module.release();
+        }
+    }
+}
 
-    const char *shaderCode = "";
-    std::string shaderSource("");
+// the embedded shaders by name, others are read from the file.
+bool
+ShaderManager::loadSource(const fs::path &path, std::string &source) {
 
     if( path == "testShader1.wgsl") {
-        shaderCode = test1Shader;
-    } else {
-
-        std::ifstream file(path);
-        if (!file.is_open()) {
-            return nullptr;
-        }
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        shaderSource.resize(size, ' ');
-        file.seekg(0);
-        file.read(shaderSource.data(), size);
-        shaderCode = shaderSource.c_str();
-        // TODO: preprocessing needs to be handled in resource target in build
-        // skip over leading R(" if present for the "includeable" shaders
-        if(shaderCode[0] == 'R'
-            && shaderCode[1] == '\"'
-            && shaderCode[2] == ')'
-           )
-         {
-            shaderCode += 3;
-         }
+        source = test1Shader;
+        return(true);
+    } else if( path == "cullInstances.wgsl") {
+        source = cullInstancesShader;
+        return(true);
+    } else if( path == "pixelReaderBlit.wgsl") {
+        source = pixelReaderBlitShader;
+        return(true);
+    } else if( path == "instanceFormats.wgsl") {
+        source = instanceFormatsShader;
+        return(true);
+    }
+
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return(false);
+    }
+    file.seekg(0, std::ios::end);
+    size_t size = file.tellg();
+    source.resize(size, ' ');
+    file.seekg(0);
+    file.read(source.data(), size);
+    // TODO: preprocessing needs to be handled in resource target in build
+    // skip over leading R(" if present for the "includeable" shaders
+    if(source.compare(0, 3, "R\"(") == 0) {
+        source.erase(0, 3);
+    }
+    return(true);
+}
+
+bool
+ShaderManager::preprocess(const fs::path &path, const std::vector<std::string> &defines, std::string &out) {
+
+    out.clear();
+    Preprocessor pp(*this, out);
+    for(const std::string &def : defines) {
+        pp.define(def);
     }
+    return(pp.run(path, 0));
+}
+
+ShaderModule
+ShaderManager::createModule(const char *shaderCode) {
+
 	ShaderModuleWGSLDescriptor shaderCodeDesc;
 	shaderCodeDesc.chain.next = nullptr;
 	shaderCodeDesc.chain.sType = SType::ShaderModuleWGSLDescriptor;
@@ -84,5 +405,59 @@ ShaderManager::loadShaderModule(const fs::path& path) {
 	return(device_.createShaderModule(shaderDesc));
 }
 
+// Sources that come out the same share a module, whatever file or defines they came
+// from, so it is only compiled once.
+ShaderModule
+ShaderManager::moduleFor(const std::string &source) {
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(unsigned char c : source) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    auto range = modules_.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it) {
+        if(it->second.source == source) {
+            return(it->second.module);
+        }
+    }
+    ShaderModule module = createModule(source.c_str());
+    if(!module) {
+        return(nullptr);
+    }
+    modules_.insert({ hash, CachedModule{ source, module } });
+    return(module);
+}
+
+ShaderModule
+ShaderManager::loadShaderModule(const fs::path& path, const std::vector<std::string> &defines) {
+
+    std::string shaderSource;
+    if(!preprocess(path, defines, shaderSource)) {
+        return nullptr;
+    }
+    return(moduleFor(shaderSource));
+}
+
+ShaderModule
+ShaderManager::getVariant(const fs::path &path, uint32_t features) {
+
+    ShaderModule &module = variants_[{ path.string(), features }];
+    if(module) {
+        return(module);
+    }
+    static const char *featureNames[] = {
+        "DYNAMIC", "TEXTURED", "EMISSIVE", "LIT", "DIRECTIONAL", "POINT",
+        "AFFINE_INSTANCES", "QUAT_INSTANCES"
+    };
+    std::vector<std::string> defines;
+    for(int i = 0; i < (int)(sizeof(featureNames) / sizeof(featureNames[0])); ++i) {
+        defines.push_back(std::string(featureNames[i]) + ((features & (1u << i)) ? "=1" : "=0"));
+    }
+    module = loadShaderModule(path, defines);
+    return(module);
+}
+
 
 ARTD_END
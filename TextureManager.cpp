@@ -127,6 +127,21 @@ class TextureManagerImpl
         }
     }
 
+    // the device's limits, textures larger than these fail to create.
+    bool checkTextureSize(const wgpu::TextureDescriptor &desc) {
+        const wgpu::Limits &limits = owner_.deviceLimits();
+        uint32_t maxDim = (desc.dimension == TextureDimension::_1D) ? limits.maxTextureDimension1D
+                        : (desc.dimension == TextureDimension::_3D) ? limits.maxTextureDimension3D
+                        : limits.maxTextureDimension2D;
+        uint32_t maxLayers = (desc.dimension == TextureDimension::_3D) ? maxDim : limits.maxTextureArrayLayers;
+        if(desc.size.width > maxDim || desc.size.height > maxDim || desc.size.depthOrArrayLayers > maxLayers) {
+            AD_LOG(error) << "texture " << desc.size.width << "x" << desc.size.height << "x" << desc.size.depthOrArrayLayers
+                          << " is larger than the device allows ( " << maxDim << " )";
+            return(false);
+        }
+        return(true);
+    }
+
     void initNullTexture() {
         using namespace wgpu;
 
@@ -146,6 +161,9 @@ class TextureManagerImpl
         tDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst;
         tDesc.viewFormatCount = 0;
         tDesc.viewFormats = nullptr;
+        if(!checkTextureSize(tDesc)) {
+            return;
+        }
         tex->tex_ = device().createTexture(tDesc);
 
         cacheTexture("null", tex );
@@ -183,6 +201,9 @@ class TextureManagerImpl
         renderTextureDesc.usage = TextureUsage::RenderAttachment | TextureUsage::TextureBinding | TextureUsage::CopyDst;
         renderTextureDesc.viewFormatCount = 0;
         renderTextureDesc.viewFormats = nullptr;
+        if(!checkTextureSize(renderTextureDesc)) {
+            return(nullptr);
+        }
         tex->tex_ = device().createTexture(renderTextureDesc);
 
         // Create test image data -
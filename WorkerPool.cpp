@@ -0,0 +1,126 @@
+#include "./WorkerPool.h"
+
+ARTD_BEGIN
+
+class WorkerPool::Worker
+    : public Runnable
+{
+    WorkerPool &pool_;
+    int index_;
+public:
+    Worker(WorkerPool &pool, int index)
+        : pool_(pool)
+        , index_(index)
+    {}
+    void run() override {
+        pool_.workerLoop(index_);
+    }
+};
+
+WorkerPool::WorkerPool(int threadCount)
+    : wake_(new WaitableSignal[threadCount > 0 ? threadCount : 0])
+{
+    for(int i = 0; i < threadCount; ++i) {
+        ObjectPtr<Thread> thread = ObjectPtr<Thread>::make(ObjectPtr<Worker>::make(*this, i));
+        thread->start();
+        threads_.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        synchronized(lock_);
+        stopping_ = true;
+    }
+    for(int i = 0; i < threadCount(); ++i) {
+        wake_[i].signal();
+    }
+    for(auto &thread : threads_) {
+        thread->join(5000);
+    }
+}
+
+// takes jobs of the current batch until there are none left.
+void
+WorkerPool::runJobs() {
+
+    for(;;) {
+        int ix;
+        const std::function<void(int)> *job;
+        {
+            synchronized(lock_);
+            if(nextJob_ >= jobCount_) {
+                return;
+            }
+            ix = nextJob_++;
+            job = job_;
+        }
+        (*job)(ix);
+
+        bool last;
+        {
+            synchronized(lock_);
+            last = (++jobsDone_ == jobCount_);
+        }
+        if(last) {
+            done_.signal();
+        }
+    }
+}
+
+void
+WorkerPool::workerLoop(int index) {
+
+    WaitableSignal &wake = wake_[index];
+    uint32_t seen = 0;
+    for(;;) {
+        // the timeout only makes it look again, a signal may be for a batch already run
+        wake.waitOnSignal(100);
+        bool newBatch;
+        {
+            synchronized(lock_);
+            if(stopping_) {
+                return;
+            }
+            newBatch = (batch_ != seen);
+            seen = batch_;
+        }
+        if(newBatch) {
+            runJobs();
+        }
+    }
+}
+
+void
+WorkerPool::run(int count, const std::function<void(int)> &job) {
+
+    if(count <= 0) {
+        return;
+    }
+    {
+        synchronized(lock_);
+        job_ = &job;
+        jobCount_ = count;
+        nextJob_ = 0;
+        jobsDone_ = 0;
+        ++batch_;
+    }
+    for(int i = 0; i < threadCount(); ++i) {
+        wake_[i].signal();
+    }
+
+    runJobs();
+    for(;;) {
+        {
+            synchronized(lock_);
+            if(jobsDone_ == jobCount_) {
+                job_ = nullptr;
+                jobCount_ = 0;
+                return;
+            }
+        }
+        done_.waitOnSignal(100);
+    }
+}
+
+ARTD_END
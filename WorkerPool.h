@@ -0,0 +1,53 @@
+#pragma once
+
+#include "artd/gpu_engine.h"
+#include "artd/ObjectBase.h"
+#include "artd/Thread.h"
+#include "artd/Mutex.h"
+#include "artd/WaitableSignal.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+ARTD_BEGIN
+
+#define INL ARTD_ALWAYS_INLINE
+
+// A few threads that run the jobs of a batch along with the thread that hands them
+// the batch, which waits for all of them to be done.  One batch at a time.
+class ARTD_API_GPU_ENGINE WorkerPool {
+
+    class Worker;
+
+    Mutex lock_;
+    std::unique_ptr<WaitableSignal[]> wake_;  // one per worker, signaled for a new batch or to stop
+    WaitableSignal done_;  // signaled when the last job of a batch is done
+
+    const std::function<void(int)> *job_ = nullptr;
+    int jobCount_ = 0;
+    int nextJob_ = 0;
+    int jobsDone_ = 0;
+    uint32_t batch_ = 0;  // bumped for each batch so workers see a new one
+    bool stopping_ = false;
+
+    std::vector<ObjectPtr<Thread>> threads_;
+
+    void workerLoop(int index);
+    void runJobs();
+
+public:
+
+    WorkerPool(int threadCount);
+    ~WorkerPool();
+
+    INL int threadCount() const {
+        return((int)threads_.size());
+    }
+
+    // calls job(i) for i in [0, count) on the workers and this thread, returns when all are done.
+    void run(int count, const std::function<void(int)> &job);
+};
+
+#undef INL
+
+ARTD_END
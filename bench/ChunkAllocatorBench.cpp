@@ -0,0 +1,342 @@
+// Replays alloc/free traces through the ChunkAllocator with a CPU stand in for
+// the GPU buffers and reports throughput, fragmentation and peak footprint.
+//
+//    ChunkAllocatorBench                       synthetic trace, default settings
+//    ChunkAllocatorBench -ops 2000000 -seed 7  synthetic trace
+//    ChunkAllocatorBench -trace file.txt       recorded trace
+//
+// A recorded trace is a text file with one operation per line:
+//
+//    a <id> <size> <usage>    allocate a chunk ( usage is the wgpu::BufferUsage flags )
+//    r <id> <size>            reallocate a chunk
+//    f <id>                   free a chunk
+//    c                        end of frame, compaction passes are run here
+//
+// sizes are in bytes, ids are any integer identifying a chunk.
+
+#include "../ChunkAllocator.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+using namespace artd;
+
+namespace {
+
+// a "buffer" is just its size, contents are not kept.
+class CpuBuffer {
+public:
+    uint64_t size_ = 0;
+
+    CpuBuffer() {}
+    explicit CpuBuffer(uint64_t size)
+        : size_(size)
+    {}
+    explicit operator bool() const {
+        return(size_ != 0);
+    }
+};
+
+class CpuBackend;
+class BenchPiece;
+typedef ChunkAllocator<CpuBackend, BenchPiece> BenchAllocator;
+
+class CpuBackend
+{
+public:
+    typedef CpuBuffer BufferT;
+
+    uint64_t footprint_ = 0;
+    uint64_t peakFootprint_ = 0;
+    uint64_t bytesMoved_ = 0;
+    uint64_t buffersCreated_ = 0;
+    bool compactionPending_ = false;
+
+    CpuBuffer createBuffer(uint64_t size, int /*usage*/, bool /*dedicated*/) {
+        size = ARTD_ALIGN_UP(size, 16);
+        footprint_ += size;
+        if (footprint_ > peakFootprint_) {
+            peakFootprint_ = footprint_;
+        }
+        ++buffersCreated_;
+        return(CpuBuffer(size));
+    }
+    void releaseBuffer(CpuBuffer &buf) {
+        footprint_ -= buf.size_;
+        buf.size_ = 0;
+    }
+    uint64_t maxBufferSize() {
+        return(256ull << 20);
+    }
+    uint32_t alignment(int usage) const {
+        return((usage & 0x40) ? 16 : 4);  // wgpu::BufferUsage::Uniform
+    }
+    void moveRanges(CpuBuffer &, const RangeMove *moves, int count) {
+        for(int i = 0; i < count; ++i) {
+            bytesMoved_ += moves[i].size;
+        }
+    }
+    bool canCompactNow() {
+        return(true);
+    }
+    void scheduleCompaction() {
+        compactionPending_ = true;
+    }
+};
+
+class BenchPiece
+{
+    CpuBuffer *parent_ = nullptr;
+    uint64_t start_ = 0;
+    uint64_t size_ = 0;
+    RangeAllocator::Block *block_ = nullptr;
+    uint32_t relocations_ = 0;
+public:
+    ~BenchPiece() {
+        BenchAllocator::releasePiece(this);
+    }
+    void setParent(CpuBuffer *buf) {
+        parent_ = buf;
+    }
+    CpuBuffer *getParentBuffer() const {
+        return(parent_);
+    }
+    void setStart(uint64_t start) {
+        start_ = start;
+    }
+    void setSize(uint64_t size) {
+        size_ = size;
+    }
+    uint64_t getSize() const {
+        return(size_);
+    }
+    void setBlock(RangeAllocator::Block *block) {
+        block_ = block;
+    }
+    RangeAllocator::Block *getBlock() const {
+        return(block_);
+    }
+    void onRelocated() {
+        ++relocations_;
+    }
+};
+
+struct TraceOp {
+    char op;
+    int64_t id;
+    uint64_t size;
+    int usage;
+};
+
+static const int usageIndex = 0x10 | 0x8;    // Index | CopyDst
+static const int usageVertex = 0x20 | 0x8;   // Vertex | CopyDst
+static const int usageUniform = 0x40 | 0x8;  // Uniform | CopyDst
+static const int usageStorage = 0x80 | 0x8;  // Storage | CopyDst
+
+// mesh like churn: mostly small vertex and index chunks with a long tail of
+// larger ones, a few uniforms and storage arrays that get resized.
+void makeSyntheticTrace(std::vector<TraceOp> &trace, int opCount, uint32_t seed) {
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<int64_t> live;
+    int64_t nextId = 1;
+    const size_t steadyLive = 4000;  // churn around this many live chunks
+
+    for(int i = 0; i < opCount; ++i) {
+        double r = unit(rng);
+        double allocOdds = live.size() < steadyLive ? 0.6 : 0.4;
+        if (live.empty() || r < allocOdds) {
+            // log uniform 16 bytes to 4MB so some go dedicated
+            uint64_t size = (uint64_t)std::exp(unit(rng) * std::log(4.0 * 1024 * 1024 / 16)) * 16;
+            int usage;
+            double u = unit(rng);
+            if (u < 0.45) {
+                usage = usageVertex;
+            } else if (u < 0.9) {
+                usage = usageIndex;
+            } else if (u < 0.95) {
+                usage = usageUniform;
+                size = std::min<uint64_t>(size, 0x10000);
+            } else {
+                usage = usageStorage;
+            }
+            trace.push_back({ 'a', nextId, size, usage });
+            live.push_back(nextId++);
+        } else if (r < 0.93 || allocOdds > 0.5) {
+            size_t ix = (size_t)(unit(rng) * live.size()) % live.size();
+            trace.push_back({ 'f', live[ix], 0, 0 });
+            live[ix] = live.back();
+            live.pop_back();
+        } else {
+            size_t ix = (size_t)(unit(rng) * live.size()) % live.size();
+            uint64_t size = (uint64_t)(unit(rng) * 0x40000) + 16;
+            trace.push_back({ 'r', live[ix], size, 0 });
+        }
+        if ((i % 1000) == 999) {
+            trace.push_back({ 'c', 0, 0, 0 });
+        }
+    }
+}
+
+bool loadTrace(const char *path, std::vector<TraceOp> &trace) {
+
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "could not open trace \"%s\"\n", path);
+        return(false);
+    }
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line)) {
+        ++lineNo;
+        std::istringstream ls(line);
+        TraceOp op = { 0, 0, 0, 0 };
+        if (!(ls >> op.op)) {
+            continue;
+        }
+        bool ok = true;
+        switch(op.op) {
+            case 'a':
+                ok = (bool)(ls >> op.id >> op.size >> op.usage);
+                break;
+            case 'r':
+                ok = (bool)(ls >> op.id >> op.size);
+                break;
+            case 'f':
+                ok = (bool)(ls >> op.id);
+                break;
+            case 'c':
+            case '#':
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d bad trace line \"%s\"\n", path, lineNo, line.c_str());
+            return(false);
+        }
+        if (op.op != '#') {
+            trace.push_back(op);
+        }
+    }
+    return(true);
+}
+
+void report(const char *what, const BenchAllocator &chunks, const CpuBackend &backend) {
+    std::vector<GpuBufferStats> perBuffer;
+    GpuBufferStats total = GpuBufferStats();
+    chunks.getStats(perBuffer, total);
+
+    double fragmentation = total.bytesFree ? (double)total.holeBytes / (double)total.bytesFree : 0.0;
+    printf("%s:\n", what);
+    printf("    buffers            %lld ( %llu created )\n", (long long)total.bufferCount, (unsigned long long)backend.buffersCreated_);
+    printf("    reserved           %lld\n", (long long)total.bytesReserved);
+    printf("    live               %lld\n", (long long)total.bytesLive);
+    printf("    free               %lld in %lld holes, largest free %lld\n",
+        (long long)total.bytesFree, (long long)total.holeCount, (long long)total.largestFreeBlock);
+    printf("    fragmentation      %.3f ( hole bytes / free bytes )\n", fragmentation);
+    printf("    peak footprint     %llu\n", (unsigned long long)backend.peakFootprint_);
+    printf("    bytes compacted    %llu\n", (unsigned long long)backend.bytesMoved_);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+
+    int opCount = 1000000;
+    uint32_t seed = 1;
+    const char *tracePath = nullptr;
+
+    for(int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-ops") && i + 1 < argc) {
+            opCount = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-ops count] [-seed n] [-trace file]\n", argv[0]);
+            return(1);
+        }
+    }
+
+    std::vector<TraceOp> trace;
+    if (tracePath) {
+        if (!loadTrace(tracePath, trace)) {
+            return(1);
+        }
+    } else {
+        makeSyntheticTrace(trace, opCount, seed);
+    }
+
+    CpuBackend backend;
+    int failed = 0;
+    int allocs = 0;
+    int64_t liveHighWater = 0;
+    double seconds;
+    {
+        BenchAllocator chunks(backend);
+        std::unordered_map<int64_t, std::unique_ptr<BenchPiece>> pieces;
+        pieces.reserve(trace.size() / 2);
+        std::vector<GpuBufferStats> perBuffer;
+        GpuBufferStats total = GpuBufferStats();
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for(const TraceOp &op : trace) {
+            switch(op.op) {
+                case 'a': {
+                    auto &piece = pieces[op.id];
+                    piece.reset(new BenchPiece());
+                    if (!chunks.allocOrRealloc(piece.get(), op.size, op.usage)) {
+                        ++failed;
+                    }
+                    ++allocs;
+                    break;
+                }
+                case 'r': {
+                    auto found = pieces.find(op.id);
+                    if (found != pieces.end()) {
+                        BenchPiece *piece = found->second.get();
+                        int usage = BenchAllocator::poolOf(piece) ? BenchAllocator::poolOf(piece)->usage_ : usageStorage;
+                        if (!chunks.allocOrRealloc(piece, op.size, usage)) {
+                            ++failed;
+                        }
+                    }
+                    break;
+                }
+                case 'f':
+                    pieces.erase(op.id);
+                    break;
+                case 'c':
+                    if (backend.compactionPending_) {
+                        backend.compactionPending_ = false;
+                        chunks.runCompactionPass();
+                    }
+                    break;
+            }
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        seconds = std::chrono::duration<double>(end - start).count();
+
+        chunks.getStats(perBuffer, total);
+        liveHighWater = total.maxUsed;
+        report("end of trace", chunks, backend);
+        pieces.clear();
+    }
+
+    printf("\n%zu operations in %.3f sec, %.1f ns/op, %.2f M ops/sec\n",
+        trace.size(), seconds, (seconds * 1e9) / (double)trace.size(), ((double)trace.size() / seconds) / 1e6);
+    printf("%d allocations, %d failed, sum of buffer high water marks %lld\n", allocs, failed, (long long)liveHighWater);
+    return(0);
+}
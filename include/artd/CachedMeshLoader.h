@@ -1,6 +1,7 @@
 #pragma once
 #include "artd/ResourceManager.h"
 #include "artd/RcString.h"
+#include "artd/Mutex.h"
 #include <filesystem>
 #include <vector>
 #include <map>
@@ -24,6 +25,7 @@ class CachedMeshLoader {
 
     typedef std::map<RcString,WeakPtr<CachedMesh>>  MMapT;
 
+    Mutex cacheLock_;  // loader threads share the cache
     MMapT cache_;
 protected:
     void onMeshDestroy(CachedMesh *mesh);
@@ -45,9 +47,19 @@ public:
 // TODO: we don't have this yet
 //    void asyncLoadMesh( StringArg pathName,  const std::function<void(ObjectPtr<DrawableMesh>)> &onDone);
 
-    // direct loaded - not async.
+    // direct loaded - not async. May be called from loader threads, uploads are
+    // published to the render thread when the thread's upload batch ends.
     ObjectPtr<DrawableMesh> loadMesh( StringArg pathName);
     ObjectPtr<DrawableMesh> createMesh(const DrawableMeshDescriptor &desc);
+
+    // meshes loaded or created between these have their data uploaded in a
+    // single copy pass when the batch is ended, and are drawn once it completes.
+    void beginBatch();
+    void endBatch();
+
+    // Static meshes share one vertex and one index buffer by default so they are
+    // drawn with offsets into them instead of re-binding. Set before loading meshes.
+    void setMegabufferMode(bool on);
 };
 
 #undef INL
@@ -66,6 +66,12 @@ public:
         farClip_ = distance;
         setViewportAltered();
     }
+    INL float getNearClip() const {
+        return(nearClip_);
+    }
+    INL float getFarClip() const {
+        return(farClip_);
+    }
 
     INL void setFocalLength(float focalLength) {
         viewAngle_ = 2 * glm::atan(1.0 / focalLength);
@@ -16,6 +16,10 @@ public:
     ObjectPtr<BufferChunk> vChunk_;
     
     int indexCount_ = 0;
+    uint64_t uploadFence_ = 0;  // upload batch the data is in, 0 if uploaded directly
+    glm::vec4 bounds_ = glm::vec4(0,0,0,-1);  // bounding sphere center and radius, radius < 0 if unknown
+    glm::vec3 boxMin_ = glm::vec3(0);  // bounding box, valid if bounds_ is
+    glm::vec3 boxMax_ = glm::vec3(0);
 
     DrawableMesh();
     virtual ~DrawableMesh();
@@ -26,12 +30,19 @@ public:
     }
 
     INL const BufferChunk &vertices() const {
-        return(*iChunk_);
+        return(*vChunk_);
     }
     
     INL int indexCount() const {
         return(indexCount_);
     }
+
+    INL bool hasBounds() const {
+        return(bounds_.w >= 0);
+    }
+
+    // sets the bounds from interleaved vertex data with the position first
+    void computeBounds(const float *vertices, int floatCount, int floatsPerVertex);
 };
 
 #undef INL
@@ -6,6 +6,7 @@
 #include <webgpu/webgpu.hpp>
 
 #include "artd/gpu_engine.h"
+#include "artd/GpuEngine-PanamaExports.h"
 #include "artd/ObjectBase.h"
 #include "artd/pointer_math.h"
 
@@ -23,8 +24,9 @@ class BufferChunk {
 protected:
 
     wgpu::Buffer *parent_;  // note this doubles as pointer to parent "Managed Buffer"
-    uint32_t size_;
-    uint32_t start_;  // 1/4 start offset
+    uint64_t size_;
+    uint64_t start_;
+    uint32_t relocations_ = 0;  // count of times moved by compaction
 
     INL BufferChunk()
         : parent_(nullptr)
@@ -32,10 +34,10 @@ protected:
         , start_(0)
     {}
     
-    INL BufferChunk(wgpu::Buffer *buf, uint64_t start, uint32_t size)
+    INL BufferChunk(wgpu::Buffer *buf, uint64_t start, uint64_t size)
         : parent_(buf)
         , size_(size)
-        , start_((uint32_t)(start >> 2))
+        , start_(start)
     {}
 public:
     
@@ -48,9 +50,9 @@ public:
         return(size_ == 0);
     }
     INL uint64_t getStartOffset() const {
-        return(start_ << 2);
+        return(start_);
     }
-    INL uint32_t getSize() const {
+    INL uint64_t getSize() const {
         return(size_);
     }
 //    INL uint32_t alignedSize() const {
@@ -61,6 +63,11 @@ public:
             return(*parent_);
         return(nullptr);
     }
+    // incremented each time the chunk's data is moved to a new start offset.
+    // anything that holds on to the offset ( bind groups ) needs to be rebuilt when changed.
+    INL uint32_t getRelocationCount() const {
+        return(relocations_);
+    }
 };
 
 
@@ -69,6 +76,8 @@ class ARTD_API_GPU_ENGINE GpuBufferManager
     friend class BufferDataImpl;
 protected:
     GpuEngineImpl &owner_;
+    uint32_t relocations_ = 0;  // count of compaction passes that moved chunks
+    uint64_t completedUploadFence_ = 0;  // last upload batch the GPU is done with
     GpuBufferManager(GpuEngineImpl *owner);
 public:
 
@@ -76,12 +85,65 @@ public:
 
     virtual ~GpuBufferManager();
 
+    // The alloc calls and upload batches may be used from loader threads, data they
+    // upload is published to the GPU by the render thread.
     virtual ObjectPtr<BufferChunk> allocUniformChunk(uint32_t size) = 0;
-    virtual ObjectPtr<BufferChunk> allocStorageChunk(uint32_t size) = 0;
+    virtual ObjectPtr<BufferChunk> allocStorageChunk(uint64_t size) = 0;
+    // Storage a shader writes, in a buffer of its own.  A buffer bound writable can not
+    // also be bound read only in the same dispatch, which pooled chunks would risk.
+    virtual ObjectPtr<BufferChunk> allocWritableStorageChunk(uint64_t size) = 0;
+    // written storage that can also be read by the indirect draw calls, in its own buffer
+    virtual ObjectPtr<BufferChunk> allocIndirectChunk(uint64_t size) = 0;
     virtual ObjectPtr<BufferChunk> allocIndexChunk(int count, const uint16_t *data) = 0;
     virtual ObjectPtr<BufferChunk> allocVertexChunk(int count, const float *data) = 0;
+    // Replaces chunk with a new one of the same usage holding at least size bytes, at
+    // least doubling it up to the device limit.  The contents are not kept and anything
+    // bound to the old chunk needs to be rebuilt.  false, chunk unchanged, if it can't.
+    virtual bool growChunk(ObjectPtr<BufferChunk> &chunk, uint64_t size) = 0;
+
+    // Per frame upload staging.  Returns where to write size bytes of data destined for
+    // dest at destOffset, valid until the next call.  nullptr if past the end of the chunk.
+    // Where dest is is looked up when flushed as it may be moved before then.
+    virtual void *stageFrameUpload(const ObjectPtr<BufferChunk> &dest, uint32_t destOffset, uint32_t size) = 0;
+    // record the copies of everything staged this frame, before the render pass is begun.
+    virtual void flushFrameUploads(wgpu::CommandEncoder &encoder) = 0;
+    // call after the frame's command buffer is submitted.
+    virtual void onFrameSubmitted() = 0;
 
     virtual void shutdown() = 0;
+    // sizes pools from the engine's device profile, before anything is allocated.
+    virtual void onDeviceCreated() = 0;
+    // When on ( the default ) index and vertex chunks all share one large buffer of each
+    // type so meshes can be drawn without re-binding.  Applies to buffers made after the call.
+    virtual void setGeometryMegabuffer(bool on) = 0;
+
+    // Upload batching.  While a batch is open the data for index and vertex chunks is
+    // packed into one staging buffer and copied when the batch is ended, instead of each
+    // allocation doing its own queue.writeBuffer().  Batches may be nested and are per thread.
+    // Other threads can't use the queue, their uploads outside a batch get one each.
+    virtual void beginUploadBatch() = 0;
+    // submits the copies, returns the batch's fence. 0 if nothing was uploaded.
+    virtual uint64_t endUploadBatch() = 0;
+    // fence for data allocated now, 0 if no batch is open.  It is complete once the
+    // batch is submitted on the render thread, later draws are queued after it.
+    virtual uint64_t currentUploadFence() = 0;
+    // true on the thread the device is used from, where uploads outside a batch are
+    // written directly
+    virtual bool isRenderThread() const = 0;
+
+    INL bool isUploadComplete(uint64_t fence) const {
+        return(fence <= completedUploadFence_);
+    }
+
+    // statistics snapshot taken in onFrameSubmitted(), safe to call from other threads.
+    virtual int getStatsBufferCount() = 0;
+    // index -1 for the totals of all buffers. false if index out of range.
+    virtual bool getBufferStats(int index, GpuBufferStats &stats) = 0;
+
+    // changes whenever any chunk is moved by compaction.
+    INL uint32_t getRelocationCount() const {
+        return(relocations_);
+    }
 
     void onContextCreated();
 
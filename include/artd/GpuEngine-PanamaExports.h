@@ -6,6 +6,27 @@
 	#define ARTD_API_GPU_ENGINE
 #endif
 
+#include <stdint.h>
+
+// Statistics for a GPU buffer managed by the GpuBufferManager, or the totals
+// for all of them.  All 64 bit so they map directly to java longs.
+typedef struct GpuBufferStats {
+    int64_t usage;              // wgpu::BufferUsage flags, 0 for totals
+    int64_t dedicated;          // 1 if holding a single large chunk
+    int64_t bufferCount;        // buffers included, 1 for a single buffer
+    int64_t bytesReserved;      // size of the GPU buffer(s)
+    int64_t bytesLive;          // bytes in allocated chunks
+    int64_t bytesFree;          // bytes available for allocation
+    int64_t holeBytes;          // free bytes not at the end of a buffer
+    int64_t holeCount;          // free ranges not at the end of a buffer
+    int64_t largestFreeBlock;   // largest single allocation that would fit
+    int64_t maxUsed;            // high water mark of the end of the used range
+    int64_t allocCount;         // chunks allocated
+    int64_t freeCount;          // chunks freed
+    int64_t uploadBytesLastFrame;  // totals only
+    int64_t uploadBytesTotal;      // totals only
+} GpuBufferStats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +39,11 @@ extern "C" {
     ARTD_API_GPU_ENGINE const int *lockPixels(int timeoutMillis);
     ARTD_API_GPU_ENGINE void unlockPixels();
 
+    // Buffer manager statistics, as of the end of the last rendered frame.
+    ARTD_API_GPU_ENGINE int getGpuBufferCount();
+    // index -1 for the totals, returns 0 on success -1 if index out of range.
+    ARTD_API_GPU_ENGINE int getGpuBufferStats(int index, GpuBufferStats *pStats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -63,11 +63,47 @@ public:
     GpuEngine();
     ~GpuEngine();
 
-    static ObjectPtr<GpuEngine> createInstance(bool headless, int width, int height);
+    // how much of the adapter's limits the device is created with
+    enum LimitsProfile {
+        LimitsMinimal,   // the WebGPU defaults, runs anywhere
+        LimitsBalanced,  // large buffers and textures up to what the adapter allows
+        LimitsMax        // everything the adapter supports
+    };
+
+    // where compiled shaders and pipelines are kept so later runs load them instead of
+    // compiling.  Off unless set, before createInstance(), null or "" turns it off.  A
+    // relative path is from the working directory so an absolute per user location is
+    // better.  The engine never removes or limits what is in it.  Only Dawn built from
+    // source has the caching interface.
+    static void setCacheDirectory(const char *path);
+    // how each instance's transform is stored for the shaders
+    enum InstanceFormat {
+        InstanceMatrix,      // the full 4x4 matrix, 80 bytes
+        InstanceAffine,      // the 3x4 affine part, 64 bytes
+        InstanceQuaternion,  // rotation, translation and uniform scale, 48 bytes
+    };
+    // set it before createInstance().  InstanceQuaternion draws sheared or unevenly
+    // scaled transforms wrong.
+    static void setInstanceFormat(InstanceFormat format);
+    static ObjectPtr<GpuEngine> createInstance(bool headless, int width, int height, LimitsProfile limits = LimitsBalanced);
     void setCurrentScene(ObjectPtr<Scene> scene);
     int run();
     
     ObjectPtr<DrawableMesh> createMesh(const DrawableMeshDescriptor &desc);
+    // draw with arguments from an indirect buffer instead of encoding them per draw.
+    void setIndirectDraws(bool on);
+    // frustum cull instances on the GPU, turns on indirect draws.
+    void setGpuCulling(bool on);
+    // frustum cull drawables on the CPU so only visible ones are uploaded and drawn.
+    void setCpuCulling(bool on);
+    // threads recording large draw lists in parallel, 1 records them on the render thread.
+    void setEncodeThreads(int count);
+    // run the input handlers and animations for the next frame on their own thread while
+    // this one renders.  While on the scene should only be changed from those.
+    void setPipelined(bool on);
+    // wrap many createMesh() calls to upload them all in one go.
+    void beginMeshBatch();
+    void endMeshBatch();
 };
 
 #undef INL
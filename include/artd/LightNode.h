@@ -42,6 +42,7 @@ protected:
 
 
     int lastTransformStamp_ = -1;
+    uint32_t dataStamp_ = 0;  // bumped when data_ other than the pose changes
     LightShaderData data_;
 
 public:
@@ -63,8 +64,13 @@ public:
 	    data = data_;
     }
 
+    INL uint32_t getDataStamp() const {
+        return(dataStamp_);
+    }
+
     INL void setLightType(Type t) {
         data_.type_ = (uint32_t)t;
+        ++dataStamp_;
     }
     
     // will set direction (orientation) of node such that it's Z is the direction
@@ -78,8 +84,14 @@ public:
     // TODO:
     INL void setDiffuse(const Color3f &color) {
         data_.diffuse_ = glm::vec4(color,0);
+        ++dataStamp_;
     }
     void setAreaWrap(float v);
+    // distance a point or spot light reaches, it is only shaded within it
+    INL void setRange(float range) {
+        data_.vec0_.y = range;
+        ++dataStamp_;
+    }
 };
 
 #undef INL
@@ -48,20 +48,34 @@ public:
         return(data_.ix_);
     }
 
+    INL uint32_t getDataStamp() const {
+        return(dataStamp_);
+    }
+
     INL void loadShaderData(MaterialShaderData &data) {
         data = data_;
     }
 
     INL void setDiffuse(const Color3f &diffuse) {
         data_.diffuse_ = diffuse;
+        ++dataStamp_;
     }
 
     INL void setEmissive(const Color3f &emissive) {
         data_.emissive_ = glm::vec4(emissive.r, emissive.g, emissive.b, 1.0);
+        ++dataStamp_;
     }
 
     INL void setShininess(float shininess) {
         data_.shininess_ = shininess;
+        ++dataStamp_;
+    }
+    // faces culled, a variant of the scene pipeline is made for ones other than Back
+    INL void setCullMode(wgpu::CullMode mode) {
+        cullMode_ = mode;
+    }
+    INL wgpu::CullMode getCullMode() const {
+        return(cullMode_);
     }
     INL void setDiffuseTex(ObjectPtr<TextureView> tView) {
         diffuseTex_ = tView;
@@ -82,6 +96,8 @@ public:
 
 private:
     MaterialShaderData data_;
+    uint32_t dataStamp_ = 1;  // bumped when data_ changes
+    wgpu::CullMode cullMode_ = wgpu::CullMode::Back;
 };
 
 #undef INL
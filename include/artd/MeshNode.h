@@ -8,7 +8,6 @@ ARTD_BEGIN
 #define INL ARTD_ALWAYS_INLINE
 
 class DrawableMesh;
-struct InstanceData;
 class Material;
 
 class MeshNode
@@ -20,13 +19,13 @@ public:
     MeshNode();
     ~MeshNode();
 
-    // load binding area for this node.  TODO: Virtual ? switch TBD
-    void loadInstanceData(InstanceData &data);
-
     void setMesh(ObjectPtr<DrawableMesh> mesh);
     void setMesh(StringArg resourcePath);
     
     DrawableMesh *getMesh() const { return(mesh_.get()); }
+    INL const ObjectPtr<DrawableMesh> &getMeshPtr() const {
+        return(mesh_);
+    }
     void setMaterial(ObjectPtr<Material> newMat);
     INL ObjectPtr<Material> &getMaterial() {
         return(material_);
@@ -65,6 +65,7 @@ class ARTD_API_GPU_ENGINE Scene
     GpuEngine *owner_;
     friend class GpuEngineImpl;
     friend class MeshNode;
+    friend class Material;
     
     ObjectPtr<TransformNode> rootNode_;
     ObjectPtr<AnimationTaskList> animationTasks_;
@@ -83,6 +84,8 @@ protected:
 
     // TODO: to be grouped by shader/pipeline  Just a hack for now.
     std::vector<MeshNode*> drawables_;
+    // bumped when drawables are added or removed or their mesh or material changes
+    uint32_t drawListVersion_ = 0;
     
     // TODO: active vs: turned off ( visible invisible ) with or without parents ...
     std::vector<LightNode*> lights_;
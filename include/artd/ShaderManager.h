@@ -3,6 +3,10 @@
 #include <webgpu/webgpu.hpp>
 #include "artd/ResourceManager.h"
 #include <filesystem>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -12,14 +16,54 @@ using namespace wgpu;
 
 #define INL ARTD_ALWAYS_INLINE
 
+// Loads WGSL run through a small preprocessor, #include "file", #define NAME [value],
+// #undef, #if #ifdef #ifndef #elif #else #endif with integer expressions of
+// defined(), ! && || comparisons and parentheses.  Defined names with a value are
+// replaced by it in the code.
 class ShaderManager {
+public:
+    // Bits picking a variant of a shader, each is #defined to 1 or 0 as its name
+    // without "Feature" in upper snake case.
+    enum Feature {
+        FeatureDynamic         = 0x01,  // decided per fragment, draws every material right
+        FeatureTextured        = 0x02,
+        FeatureEmissive        = 0x04,
+        FeatureLit             = 0x08,  // there are lights
+        FeatureDirectional     = 0x10,  // directional lights present
+        FeaturePoint           = 0x20,  // point lights present
+        FeatureAffineInstances = 0x40,  // GpuEngine::InstanceAffine instance data
+        FeatureQuatInstances   = 0x80,  // GpuEngine::InstanceQuaternion instance data
+    };
+
+private:
+    struct CachedModule {
+        std::string source;  // compared as sources may share a hash
+        ShaderModule module = nullptr;
+    };
+
     Device device_ = nullptr;
+    std::unordered_multimap<uint64_t, CachedModule> modules_;  // by the hash of their source
+    std::map<std::pair<std::string,uint32_t>, ShaderModule> variants_;  // in modules_
+
+    ShaderModule createModule(const char *code);
+    ShaderModule moduleFor(const std::string &source);
+
 public:
     ShaderManager(Device device);
-    ShaderModule loadShaderModule(const fs::path& path);
-};
+    ~ShaderManager();
 
+    // an embedded shader by name or the file, false if it is neither
+    bool loadSource(const fs::path &path, std::string &source);
+    // defines are "NAME" or "NAME=value", the module is kept here and shared by all
+    // loads that preprocess to the same source
+    ShaderModule loadShaderModule(const fs::path& path, const std::vector<std::string> &defines = {});
+    // the module for the feature bits, made the first time and kept here
+    ShaderModule getVariant(const fs::path &path, uint32_t features);
+    // the source after the preprocessor, false if it or an include could not be read
+    bool preprocess(const fs::path &path, const std::vector<std::string> &defines, std::string &out);
+};
 
+#undef INL
 
 ARTD_END
 
@@ -0,0 +1,85 @@
+R"(  // this here so can be included in C++ as a string - file reader needs to strip out if present
+
+// Frustum culls the instances of the draw groups.  Each visible instance bumps its
+// group's instance count in the indirect draw arguments and writes its index into
+// the group's range of the visible array, which the vertex shader reads through.
+
+// the front of SceneUniforms, the lights are not needed here
+struct SceneUniforms {
+    projectionMatrix: mat4x4f,
+    viewMatrix: mat4x4f,
+    vpMatrix: mat4x4f, // projection * view;
+    eyePose:  mat4x4f, // orientation of camera.
+    test: mat4x4f,
+    time: f32,
+    passType: u32,
+    numLights: u32,
+    cullCount: u32,  // instances to cull, 0 when not culling
+};
+
+#include "instanceFormats.wgsl"
+
+struct CullInput {
+    sphere: vec4f,  // mesh bounds center and radius, radius < 0 if not known
+    group: u32,
+    unused0_: u32,
+    unused1_: u32,
+    unused2_: u32,
+};
+
+struct DrawArgs {
+    indexCount: u32,
+    instanceCount: atomic<u32>,
+    firstIndex: u32,
+    baseVertex: i32,
+    firstInstance: u32,
+};
+
+@group(0) @binding(0) var<uniform> scnUniforms: SceneUniforms;
+@group(0) @binding(1) var<storage, read> instanceArray : array<InstanceData>;
+@group(0) @binding(2) var<storage, read> cullArray : array<CullInput>;
+@group(0) @binding(3) var<storage, read_write> drawArgs : array<DrawArgs>;
+@group(0) @binding(4) var<storage, read_write> visibleArray : array<u32>;
+
+fn row(m: mat4x4f, i: u32) -> vec4f {
+    return vec4f(m[0][i], m[1][i], m[2][i], m[3][i]);
+}
+
+fn sphereVisible(center: vec3f, radius: f32) -> bool {
+    let m = scnUniforms.vpMatrix;
+    let r0 = row(m, 0u);
+    let r1 = row(m, 1u);
+    let r2 = row(m, 2u);
+    let r3 = row(m, 3u);
+    // left right bottom top near far, near as for -w..w depth which is looser for 0..w
+    var planes = array<vec4f, 6>(r3 + r0, r3 - r0, r3 + r1, r3 - r1, r3 + r2, r3 - r2);
+    for(var i = 0; i < 6; i += 1) {
+        let p = planes[i];
+        if(dot(p.xyz, center) + p.w < -radius * length(p.xyz)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+@compute @workgroup_size(64)
+fn cull_main(@builtin(global_invocation_id) id: vec3u) {
+
+    let ix = id.x;
+    if(ix >= scnUniforms.cullCount) {
+        return;
+    }
+    let cull = cullArray[ix];
+    let inst = instanceArray[ix];
+
+    var visible = cull.sphere.w < 0.0;
+    if(!visible) {
+        let center = instancePoint(inst, cull.sphere.xyz);
+        visible = sphereVisible(center, cull.sphere.w * instanceScale(inst));
+    }
+    if(visible) {
+        let slot = atomicAdd(&drawArgs[cull.group].instanceCount, 1u);
+        visibleArray[drawArgs[cull.group].firstInstance + slot] = ix;
+    }
+}
+// )"; // this is here to terminate when included in C++
@@ -0,0 +1,84 @@
+R"(  // this here so can be included in C++ as a string - file reader needs to strip out if present
+
+// The encodings of an instance in the instance array, picked by AFFINE_INSTANCES or
+// QUAT_INSTANCES, the full model matrix otherwise.  As InstanceData, InstanceDataAffine
+// and InstanceDataQuat in GpuEngineImpl.h.  Each has instancePoint() for a model space
+// position, instanceNormal() for a normal, not normalized, and instanceScale() for the
+// largest scale of an axis.
+
+#if AFFINE_INSTANCES
+
+struct InstanceData {
+    rows: array<vec4f, 3>,  // the top three rows of the model matrix
+    materialIx: u32,
+    objectId: u32,
+};
+
+fn instancePoint(inst: InstanceData, p: vec3f) -> vec3f {
+    let p4 = vec4f(p, 1.0);
+    return vec3f(dot(inst.rows[0], p4), dot(inst.rows[1], p4), dot(inst.rows[2], p4));
+}
+
+fn instanceNormal(inst: InstanceData, n: vec3f) -> vec3f {
+    return vec3f(dot(inst.rows[0].xyz, n), dot(inst.rows[1].xyz, n), dot(inst.rows[2].xyz, n));
+}
+
+fn instanceScale(inst: InstanceData) -> f32 {
+    let r0 = inst.rows[0];
+    let r1 = inst.rows[1];
+    let r2 = inst.rows[2];
+    return max(length(vec3f(r0.x, r1.x, r2.x)), max(length(vec3f(r0.y, r1.y, r2.y)), length(vec3f(r0.z, r1.z, r2.z))));
+}
+
+#elif QUAT_INSTANCES
+
+struct InstanceData {
+    rotation: vec4f,  // unit quaternion x y z w
+    translation: vec3f,
+    scale: f32,
+    materialIx: u32,
+    objectId: u32,
+};
+
+fn quatRotate(q: vec4f, v: vec3f) -> vec3f {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+fn instancePoint(inst: InstanceData, p: vec3f) -> vec3f {
+    return quatRotate(inst.rotation, p * inst.scale) + inst.translation;
+}
+
+// the scale is uniform so the normal only needs the rotation
+fn instanceNormal(inst: InstanceData, n: vec3f) -> vec3f {
+    return quatRotate(inst.rotation, n);
+}
+
+fn instanceScale(inst: InstanceData) -> f32 {
+    return abs(inst.scale);
+}
+
+#else
+
+struct InstanceData {
+    modelMatrix: mat4x4f,
+    materialIx: u32,
+    objectId: u32,
+    unused2_: u32, // pad for 16 bytes alignment (needed ? )
+};
+
+fn instancePoint(inst: InstanceData, p: vec3f) -> vec3f {
+    return (inst.modelMatrix * vec4f(p, 1.0)).xyz;
+}
+
+fn instanceNormal(inst: InstanceData, n: vec3f) -> vec3f {
+    let m = inst.modelMatrix;
+    return mat3x3f(m[0].xyz, m[1].xyz, m[2].xyz) * n;
+}
+
+fn instanceScale(inst: InstanceData) -> f32 {
+    let m = inst.modelMatrix;
+    return max(length(m[0].xyz), max(length(m[1].xyz), length(m[2].xyz)));
+}
+
+#endif
+// )"; // this is here to terminate when included in C++
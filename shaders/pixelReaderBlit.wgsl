@@ -0,0 +1,22 @@
+R"(  // this here so can be included in C++ as a string - file reader needs to strip out if present
+
+// Copies the rendered texture to the read back target with gamma applied.
+
+var<private> pos : array<vec2<f32>, 3> = array<vec2<f32>, 3>(
+	vec2<f32>(-1.0, -1.0), vec2<f32>(-1.0, 3.0), vec2<f32>(3.0, -1.0)
+);
+
+@group(0) @binding(0) var texture: texture_2d<f32>;
+
+@vertex
+fn vs_main(@builtin(vertex_index) vertexIndex: u32) -> @builtin(position) vec4<f32> {
+	return vec4(pos[vertexIndex], 1.0, 1.0);
+}
+
+@fragment
+fn fs_main(@builtin(position) fragCoord: vec4<f32>) -> @location(0) vec4<f32> {
+	let color = textureLoad(texture, vec2<i32>(fragCoord.xy), 0);
+	let corrected_color = pow(color.rgb, vec3<f32>(1.0/2.2));
+	return vec4<f32>(corrected_color, color.a);
+}
+// )"; // this is here to terminate when included in C++
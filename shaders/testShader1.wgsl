@@ -30,16 +30,12 @@ struct SceneUniforms {
     time: f32,
     passType: u32,  // 0 opaque, 1 transparency, 3 ID pick
     numLights: u32,
-    pad1: f32,
-    lights: array<LightData,64>
+    cullCount: u32,  // non zero when instances are culled, see cullInstances.wgsl
+    clusterScale: vec4f,  // tiles per pixel x y, depth slice scale and bias
+    numGlobalLights: u32,  // lit everywhere, at the front of lightIndexArray
 };
 
-struct InstanceData {
-    modelMatrix: mat4x4f,
-    materialIx: u32,
-    objectId: u32,
-    unused2_: u32, // pad for 16 bytes alignment (needed ? )
-};
+#include "instanceFormats.wgsl"
 
 struct MaterialData {
     diffuse: vec3f,
@@ -65,6 +61,26 @@ struct VertexOutput {
 @group(0) @binding(1) var<storage> instanceArray : array<InstanceData>;
 @group(0) @binding(2) var<storage> materialArray : array<MaterialData>;
 @group(0) @binding(3) var sampler0: sampler;
+// instance indices of a culled frame, packed by draw group
+@group(0) @binding(4) var<storage> visibleArray : array<u32>;
+// scnUniforms.numLights of them
+@group(0) @binding(5) var<storage> lightArray : array<LightData>;
+// offset and count in lightIndexArray of each cluster's lights
+@group(0) @binding(6) var<storage> clusterArray : array<vec2u>;
+@group(0) @binding(7) var<storage> lightIndexArray : array<u32>;
+
+// the cluster grid, as in LightClusters.h
+const ClusterTilesX = 16u;
+const ClusterTilesY = 9u;
+const ClusterSlices = 24u;
+
+fn clusterIndex(fragCoord: vec2f, viewDepth: f32) -> u32 {
+    let scale = scnUniforms.clusterScale;
+    let x = min(u32(fragCoord.x * scale.x), ClusterTilesX - 1u);
+    let y = min(u32(fragCoord.y * scale.y), ClusterTilesY - 1u);
+    let z = u32(clamp(log(max(viewDepth, 1e-6)) * scale.z + scale.w, 0.0, f32(ClusterSlices - 1u)));
+    return x + ClusterTilesX * (y + ClusterTilesY * z);
+}
 
 // material bind group
 @group(1) @binding(0) var texture0: texture_2d<f32>;
@@ -74,38 +90,57 @@ fn vs_main(in: VertexInput) -> VertexOutput {
 	var out: VertexOutput;
 // Use the instance index to retrieve the matrix !!  indexData[in.instanceIx]
 
-    let mMat = instanceArray[in.instanceIx].modelMatrix;
+    var ix = in.instanceIx;
+    if(scnUniforms.cullCount != 0u) {
+        ix = visibleArray[ix];
+    }
+    let inst = instanceArray[ix];
 
-    out.worldPos = mMat * vec4f(in.position, 1.0);
+    out.worldPos = vec4f(instancePoint(inst, in.position), 1.0);
     out.position = scnUniforms.vpMatrix * out.worldPos;
 	out.uv = in.uv;
 
 	// Forward the normal
-	// TODO: pass in a normal "pose" matrix? in instance data ?
-    let nMat = mat3x3f(mMat[0].xyz, mMat[1].xyz, mMat[2].xyz);
-    out.normal = normalize(nMat * in.normal);
+    out.normal = normalize(instanceNormal(inst, in.normal));
 
-	out.materialIx = instanceArray[in.instanceIx].materialIx;
+	out.materialIx = inst.materialIx;
     return out;
 }
 
+// Built in variants by ShaderManager::getVariant() with the branches their materials
+// and lights take, the DYNAMIC one decides them per fragment.
 @fragment
 fn fs_main(in: VertexOutput) -> @location(0) vec4f {
 	let normal = normalize(in.normal); // the interpolator doesn't keep it normalized !!! ie: rotate it !
 
     let material = materialArray[in.materialIx]; // indirection or by value ? or is it a reference ?
 
+#if DYNAMIC
     let texDim = textureDimensions(texture0);
     let hasTex0 = (texDim.x + texDim.y) != 2;
+#endif
 
     var diffuseMult = vec3f(0,0,0);
     var specularMult = vec3f(0,0,0);
 
-    for(var lix = u32(0); lix < scnUniforms.numLights; lix += 1)  {
+#if DYNAMIC || LIT
+    // the lights lit everywhere then those reaching this fragment's cluster
+    let viewDepth = -(scnUniforms.viewMatrix * in.worldPos).z;
+    let cluster = clusterArray[clusterIndex(in.position.xy, viewDepth)];
+    let numGlobal = scnUniforms.numGlobalLights;
+
+    for(var k = u32(0); k < numGlobal + cluster.y; k += 1)  {
 
-        let light = scnUniforms.lights[lix];
+        var lix: u32;
+        if(k < numGlobal) {
+            lix = lightIndexArray[k];
+        } else {
+            lix = lightIndexArray[cluster.x + k - numGlobal];
+        }
+        let light = lightArray[lix];
 
         switch light.lightType {
+#if DYNAMIC || DIRECTIONAL
             case 0: { // directional
 
                 var incidence = dot(light.pose[2],normal); // z axis of rotation, light direction - pre normalized
@@ -170,15 +205,35 @@ fn fs_main(in: VertexOutput) -> @location(0) vec4f {
                     diffuseMult += shading;
                 }
             }
+#endif
+#if DYNAMIC || POINT
+            case 2: { // point, vec0.y is the range it reaches
+                let toLight = light.position - in.worldPos.xyz;
+                let dist = max(length(toLight), 1e-4);
+                let range = light.vec0.y;
+                if(dist < range) {
+                    let incidence = dot(toLight / dist, normal);
+                    if(incidence > 0.) {
+                        let falloff = 1.0 - (dist * dist) / (range * range);
+                        diffuseMult += light.diffuse * (incidence * falloff * falloff);
+                    }
+                }
+            }
+#endif
             default: {
                 // do nothing !
             }
         }
     }
+#endif
     var diffColor: vec3f;
     var emitColor = vec3f(0,0,0);
 
+    // variants have only the branch their materials take
+#if DYNAMIC
     if(hasTex0) {
+#endif
+#if DYNAMIC || TEXTURED
     	// maybe if we don't use a sampler.
     	// We remap UV coords to actual texel coordinates
         //	let texelCoords = vec2i(in.uv * vec2f(textureDimensions(tex0)));
@@ -187,7 +242,9 @@ fn fs_main(in: VertexOutput) -> @location(0) vec4f {
         //	let color = textureLoad(tex0, texelCoords, 0).rgb;
 
         diffColor = textureSample(texture0, sampler0, in.uv).rgb;
+#if DYNAMIC || EMISSIVE
         emitColor = diffColor *  material.emissive.xyz;
+#endif
         diffColor = diffColor * material.diffuse;
 
 
@@ -205,10 +262,19 @@ fn fs_main(in: VertexOutput) -> @location(0) vec4f {
 //            diffuseMult = dmult*max;
 //        }
 */
+#endif
+#if DYNAMIC
     } else {
+#endif
+#if DYNAMIC || !TEXTURED
         diffColor = material.diffuse;
+#if DYNAMIC || EMISSIVE
         emitColor = diffColor *  material.emissive.xyz;
+#endif
+#endif
+#if DYNAMIC
     }
+#endif
 
 	var color = diffColor * diffuseMult + emitColor + specularMult; // shading;
     if(color.x > 1.0) {